@@ -0,0 +1,164 @@
+/*
+ * access_log.c: Records the arrival time and URI of each request the server
+ * reads, so that the client can replay the same request sequence later.
+ *
+ * The log starts with ACCESS_LOG_MAGIC, followed by one packed record per
+ * request: the time since the previous record in us, as a 4-byte int, the
+ * length of the URI, as a 2-byte unsigned short, and the URI without its
+ * nul. Records are written in the order that requests are read, which is not
+ * quite the order in which they arrived, so a time may be negative. Reading
+ * the log puts the requests back in arrival order.
+ *
+ * The server records from all its threads into one buffered stream under a
+ * lock, which only costs anything when recording is on.
+ */
+
+#include <limits.h>
+#include "common.h"
+#include "access_log.h"
+
+#define ACCESS_LOG_MAGIC "WSACCES1"
+#define ACCESS_LOG_RECORD_SIZE (sizeof(int) + sizeof(unsigned short))
+#define ACCESS_LOG_MAX_URI 65535
+
+struct access_log {
+	FILE *f;
+	pthread_mutex_t lock;
+	long last_us;		/* of the previous record */
+	int nr_records;
+	int ok;			/* no write has failed */
+};
+
+/* returns NULL, with errno set, if path cannot be created */
+struct access_log *
+access_log_open(const char *path)
+{
+	struct access_log *log;
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL)
+		return NULL;
+	log = Malloc(sizeof(struct access_log));
+	log->f = f;
+	pthread_mutex_init(&log->lock, NULL);
+	log->last_us = 0;
+	log->nr_records = 0;
+	log->ok = fwrite(ACCESS_LOG_MAGIC, strlen(ACCESS_LOG_MAGIC), 1,
+			 f) == 1;
+	return log;
+}
+
+/* records a request for uri that arrived at ns, in CLOCK_MONOTONIC time */
+void
+access_log_record(struct access_log *log, long ns, const char *uri)
+{
+	char rec[ACCESS_LOG_RECORD_SIZE];
+	unsigned short len;
+	long delta;
+	int us;
+
+	len = strnlen(uri, ACCESS_LOG_MAX_URI);
+	pthread_mutex_lock(&log->lock);
+	delta = log->nr_records ? ns / 1000 - log->last_us : 0;
+	/* only a gap of over half an hour does not fit */
+	us = delta > INT_MAX ? INT_MAX : delta < INT_MIN ? INT_MIN : delta;
+	log->last_us = log->nr_records ? log->last_us + us : ns / 1000;
+	memcpy(rec, &us, sizeof(int));
+	memcpy(rec + sizeof(int), &len, sizeof(unsigned short));
+	if (log->ok)
+		log->ok = fwrite(rec, sizeof(rec), 1, log->f) == 1 &&
+			fwrite(uri, len, 1, log->f) == 1;
+	log->nr_records++;
+	pthread_mutex_unlock(&log->lock);
+}
+
+/* flushes and closes the log. no thread may record any more. returns 0,
+ * with errno set, if a write failed */
+int
+access_log_close(struct access_log *log)
+{
+	int ok = log->ok;
+
+	if (!log->ok)
+		errno = EIO;
+	if (fclose(log->f) != 0)
+		ok = 0;
+	pthread_mutex_destroy(&log->lock);
+	free(log);
+	return ok;
+}
+
+static int
+access_record_cmp(const void *a, const void *b)
+{
+	long ua = ((const struct access_record *)a)->us;
+	long ub = ((const struct access_record *)b)->us;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* reads the log in path, and returns its requests in arrival order, with
+ * times counted from the first one. returns NULL, with errno set, if path
+ * cannot be read or is not an access log. a log that ends part way through
+ * a record, as when the server was killed, is read up to that record. */
+struct access_record *
+access_log_read(const char *path, int *nr_records)
+{
+	struct access_record *records = NULL;
+	char magic[sizeof(ACCESS_LOG_MAGIC) - 1];
+	char rec[ACCESS_LOG_RECORD_SIZE];
+	int i, n = 0, max = 0, us;
+	unsigned short len;
+	long now = 0, first;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return NULL;
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, ACCESS_LOG_MAGIC, sizeof(magic)) != 0) {
+		fclose(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	while (fread(rec, sizeof(rec), 1, f) == 1) {
+		memcpy(&us, rec, sizeof(int));
+		memcpy(&len, rec + sizeof(int), sizeof(unsigned short));
+		if (n == max) {
+			max = max ? max * 2 : 1024;
+			records = realloc(records,
+					  max * sizeof(struct access_record));
+			assert(records);
+		}
+		records[n].uri = Malloc(len + 1);
+		if (fread(records[n].uri, len, 1, f) != 1 && len > 0) {
+			free(records[n].uri);
+			break;
+		}
+		records[n].uri[len] = '\0';
+		now += us;
+		records[n].us = now;
+		n++;
+	}
+	fclose(f);
+	if (n > 0)
+		qsort(records, n, sizeof(struct access_record),
+		      access_record_cmp);
+	first = n ? records[0].us : 0;
+	for (i = 0; i < n; i++) {
+		records[i].us -= first;
+	}
+	*nr_records = n;
+	/* an empty log still returns an array */
+	return records ? records : Malloc(sizeof(struct access_record));
+}
+
+void
+access_log_free(struct access_record *records, int nr_records)
+{
+	int i;
+
+	for (i = 0; i < nr_records; i++) {
+		free(records[i].uri);
+	}
+	free(records);
+}
@@ -0,0 +1,19 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+/* a request read back from an access log */
+struct access_record {
+	long us;		/* arrival, in us after the first request */
+	char *uri;
+};
+
+struct access_log;
+
+struct access_log *access_log_open(const char *path);
+void access_log_record(struct access_log *log, long ns, const char *uri);
+int access_log_close(struct access_log *log);
+
+struct access_record *access_log_read(const char *path, int *nr_records);
+void access_log_free(struct access_record *records, int nr_records);
+
+#endif /* __ACCESS_LOG_H__ */
@@ -0,0 +1,124 @@
+/*
+ * bytesum.c: Sums of unsigned bytes, used for the Content-Csum header and
+ * by request_processfile.
+ *
+ * On x86, the SSE2 and AVX2 kernels use psadbw, which adds up groups of 8
+ * bytes into 64-bit lanes, so no lane can overflow. The result is truncated
+ * to 32 bits at the end, which gives exactly the same value as adding the
+ * bytes one at a time into an unsigned int. The fastest kernel that the CPU
+ * supports is picked on the first call.
+ */
+
+#include <stdint.h>
+#include "common.h"
+#include "bytesum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BYTESUM_X86
+#include <immintrin.h>
+#endif
+
+static unsigned int
+bytesum_scalar(const void *buf, long len)
+{
+	const unsigned char *p = buf;
+	unsigned int sum = 0;
+	long i;
+
+	for (i = 0; i < len; i++) {
+		sum += p[i];
+	}
+	return sum;
+}
+
+#ifdef BYTESUM_X86
+
+__attribute__((target("sse2")))
+static unsigned int
+bytesum_sse2(const void *buf, long len)
+{
+	const unsigned char *p = buf;
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	uint64_t lanes[2];
+	long i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	return (unsigned int)(lanes[0] + lanes[1]) + bytesum_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+bytesum_avx2(const void *buf, long len)
+{
+	const unsigned char *p = buf;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	long i = 0;
+
+	/* two accumulators to hide the latency of the adds */
+	for (; i + 64 <= len; i += 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(v1, zero));
+	}
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v, zero));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+	return (unsigned int)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+		bytesum_sse2(p + i, len - i);
+}
+
+#endif /* BYTESUM_X86 */
+
+static const struct bytesum_kernel all_kernels[] = {
+	{"scalar", bytesum_scalar},
+#ifdef BYTESUM_X86
+	{"sse2", bytesum_sse2},
+	{"avx2", bytesum_avx2},
+#endif
+};
+
+int
+bytesum_kernels(const struct bytesum_kernel **kernels)
+{
+	int nr = 1;
+
+#ifdef BYTESUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		nr = 2;
+		if (__builtin_cpu_supports("avx2"))
+			nr = 3;
+	}
+#endif
+	*kernels = all_kernels;
+	return nr;
+}
+
+static unsigned int (*bytesum_best)(const void *buf, long len);
+
+unsigned int
+bytesum(const void *buf, long len)
+{
+	unsigned int (*sum)(const void *, long);
+
+	sum = __atomic_load_n(&bytesum_best, __ATOMIC_RELAXED);
+	if (sum == NULL) {
+		/* every thread that races here picks the same kernel */
+		const struct bytesum_kernel *kernels;
+		int nr = bytesum_kernels(&kernels);
+		sum = kernels[nr - 1].sum;
+		__atomic_store_n(&bytesum_best, sum, __ATOMIC_RELAXED);
+	}
+	return sum(buf, len);
+}
@@ -0,0 +1,16 @@
+#ifndef __BYTESUM_H__
+#define __BYTESUM_H__
+
+/* sums len bytes of buf as unsigned chars, modulo 2^32 */
+unsigned int bytesum(const void *buf, long len);
+
+struct bytesum_kernel {
+	const char *name;
+	unsigned int (*sum)(const void *buf, long len);
+};
+
+/* sets *kernels to the kernels this CPU supports, fastest last, and returns
+ * how many there are */
+int bytesum_kernels(const struct bytesum_kernel **kernels);
+
+#endif /* __BYTESUM_H__ */
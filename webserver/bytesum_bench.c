@@ -0,0 +1,134 @@
+/*
+ * bytesum_bench.c: Throughput of the byte-sum kernels.
+ *
+ * To run:
+ *  bytesum_bench [-m mean_file_size] [-n nr_files] [-p nr_passes]
+ *
+ * Generates buffers with the same sizes as the fileset program, checks that
+ * every kernel the CPU supports gives the same sums as the scalar kernel, and
+ * reports the GB/s of each kernel over nr_passes passes over all buffers.
+ */
+
+#include <popt.h>
+#include "common.h"
+#include "bytesum.h"
+
+poptContext context;	/* context for parsing command-line options */
+
+/* same defaults as the fileset program */
+#define DEFAULT_MEAN_FILE_SZ 3
+#define DEFAULT_NR_FILES 256
+#define DEFAULT_NR_PASSES 200
+
+static int mean_file_sz = DEFAULT_MEAN_FILE_SZ;
+static int nr_files = DEFAULT_NR_FILES;
+static int nr_passes = DEFAULT_NR_PASSES;
+
+struct fileset {
+	int nr_files;
+	char **bufs;
+	int *sizes;
+	long total;
+};
+
+/* fills buffers with the file sizes of the fileset program */
+static void
+fileset_init(struct fileset *fs)
+{
+	int i, n;
+
+	fs->nr_files = fileset_sizes(mean_file_sz, nr_files, &fs->sizes);
+	fs->bufs = Malloc(fs->nr_files * sizeof(char *));
+	fs->total = 0;
+	for (n = 0; n < fs->nr_files; n++) {
+		fs->bufs[n] = Malloc(fs->sizes[n]);
+		for (i = 0; i < fs->sizes[n]; i++) {
+			fs->bufs[n][i] = random();
+		}
+		fs->total += fs->sizes[n];
+	}
+}
+
+static void
+fileset_destroy(struct fileset *fs)
+{
+	int i;
+
+	for (i = 0; i < fs->nr_files; i++) {
+		free(fs->bufs[i]);
+	}
+	free(fs->bufs);
+	free(fs->sizes);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	const struct bytesum_kernel *kernels;
+	struct fileset fs;
+	struct timeval start, end, diff;
+	int c, i, k, pass, nr_kernels;
+
+	struct poptOption options_table[] = {
+		{NULL, 'm', POPT_ARG_INT, &mean_file_sz, 'm',
+		 "mean file size, in 4K units",
+		 " default: " STR(DEFAULT_MEAN_FILE_SZ)},
+		{NULL, 'n', POPT_ARG_INT, &nr_files, 'n',
+		 "number of files",
+		 " default: " STR(DEFAULT_NR_FILES)},
+		{NULL, 'p', POPT_ARG_INT, &nr_passes, 'p',
+		 "number of passes over all files",
+		 " default: " STR(DEFAULT_NR_PASSES)},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	if (mean_file_sz <= 1 || nr_files <= 0 || nr_passes <= 0) {
+		poptPrintUsage(context, stderr, 0);
+		exit(1);
+	}
+
+	fileset_init(&fs);
+	nr_kernels = bytesum_kernels(&kernels);
+	printf("%d files, %ld bytes\n", fs.nr_files, fs.total);
+
+	/* all kernels must agree with the scalar kernel, including on the
+	 * unaligned tails */
+	for (i = 0; i < fs.nr_files; i++) {
+		for (k = 1; k < nr_kernels; k++) {
+			int off = i % 7;
+			assert(kernels[k].sum(fs.bufs[i], fs.sizes[i]) ==
+			       kernels[0].sum(fs.bufs[i], fs.sizes[i]));
+			assert(kernels[k].sum(fs.bufs[i] + off, fs.sizes[i] - off) ==
+			       kernels[0].sum(fs.bufs[i] + off, fs.sizes[i] - off));
+		}
+	}
+
+	printf("kernel, GB/s\n");
+	for (k = 0; k < nr_kernels; k++) {
+		volatile unsigned int sink = 0;
+		double secs;
+
+		gettimeofday(&start, NULL);
+		for (pass = 0; pass < nr_passes; pass++) {
+			for (i = 0; i < fs.nr_files; i++) {
+				sink += kernels[k].sum(fs.bufs[i], fs.sizes[i]);
+			}
+		}
+		gettimeofday(&end, NULL);
+		timersub(&end, &start, &diff);
+		secs = (double)diff.tv_sec + (double)diff.tv_usec / 1000000;
+		printf("%s, %.2f\n", kernels[k].name,
+		       (double)fs.total * nr_passes / secs / 1e9);
+		fflush(stdout);
+	}
+	fileset_destroy(&fs);
+	exit(0);
+}
@@ -0,0 +1,757 @@
+#include "request.h"
+#include "cache.h"
+#include "sketch.h"
+#include "policy.h"
+#include "trace.h"
+#include "epoch.h"
+#include "common.h"
+
+// Hash Function for hash table
+// Hash function used is djb2, obtained from
+// http://www.cse.yorku.ca/~oz/hash.html
+static unsigned long
+hash(char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+	return hash;
+}
+
+// Smallest number of buckets per shard
+#define CACHE_MIN_CAPACITY 16
+// Number of buckets moved to the new table per insert while resizing
+#define CACHE_REHASH_STEP 4
+// With admission enabled, each shard's frequency sketch has one counter per
+// this many bytes of its budget, but at least CACHE_MIN_SKETCH_WIDTH
+#define CACHE_SKETCH_BYTES 4096
+#define CACHE_MIN_SKETCH_WIDTH 256
+// Policies that need lru_lock for a hit see one in this many hits of an entry
+#define CACHE_HIT_SAMPLE 8
+
+// A miss that is being read from disk. Later requests for the same file wait
+// on cv for the result instead of reading the file again.
+struct cache_flight {
+	unsigned long hash;
+	char *file_name;	// Owned by the loading request
+	struct file_data *data;	// Result, or NULL if the read failed
+	int done;
+	int nr_waiters;
+	pthread_cond_t cv;
+	struct cache_flight *next;
+};
+
+// Chained hash table. The capacity is always a power of two.
+typedef struct cache_table {
+	CacheEntry **buckets;
+	unsigned long capacity;
+} CacheTable;
+
+// Each shard is an independent cache with its own lock, hash table, eviction
+// policy state and share of the byte budget. A file always maps to the same shard.
+//
+// The hash table grows and shrinks with the number of entries. Resizing is
+// incremental: while rehash_idx >= 0, entries live in either table[0] or
+// table[1], and every insert moves a few more buckets of table[0] over.
+//
+// Lookups take no lock. They walk the chains inside an epoch (see epoch.c),
+// so that the entries and bucket arrays that writers unlink are only freed
+// once no lookup can still be reading them. Inserts and evictions hold lock
+// exclusively and change each chain with a single atomic store. Moving
+// entries to the other table can hide an entry from a walk, so writers bump
+// seq to an odd value while they change the tables, and a lookup that
+// missed while seq changed looks again with lock held in shared mode.
+//
+// Hits are reported to the policy without a lock if the policy allows it.
+// Otherwise only a sample of them is, under lru_lock, and skipped when it is
+// busy. Writers hold lru_lock too, while they change the policy state.
+// The list of misses in flight is protected by flight_lock, which is taken
+// before lock when both are needed.
+typedef struct cache_shard {
+	CacheTable table[2];
+	long rehash_idx;	// Next table[0] bucket to move, or -1
+	unsigned long seq;	// Odd while the tables are being changed
+	long nr_entries;
+	void *policy_state;
+
+	long size;
+	long max_cache_size;
+	long nr_evictions;
+
+	pthread_rwlock_t lock;
+	pthread_mutex_t lru_lock;
+
+	CacheFlight *flights;
+	pthread_mutex_t flight_lock;
+
+	// Request frequencies for the admission filter, or NULL if disabled
+	struct sketch *sketch;
+} CacheShard;
+
+struct cache {
+	CacheShard *shards;
+	int nr_shards;
+	const struct cache_policy *policy;
+	struct epoch *epoch;
+};
+
+// ======================== Hashtable Operations ========================
+
+// Drops the cache's reference to the entry data. The data itself is freed
+// once the last request sending it is done with it.
+static void
+cache_entry_free(void *arg)
+{
+	CacheEntry *entry = arg;
+
+	file_data_put(entry->data);
+	free(entry);
+}
+
+static void shard_write_lock(CacheShard *shard) {
+	pthread_rwlock_wrlock(&shard->lock);
+	pthread_mutex_lock(&shard->lru_lock);
+}
+
+static void shard_write_unlock(CacheShard *shard) {
+	pthread_mutex_unlock(&shard->lru_lock);
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+// Brackets a change to the tables that a lookup without the lock could see
+// half done. Only called with lock held exclusively.
+static void shard_seq_begin(CacheShard *shard) {
+	__atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shard_seq_end(CacheShard *shard) {
+	__atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+static CacheShard *cache_shard(Cache *cache, unsigned long h) {
+	return &cache->shards[h % cache->nr_shards];
+}
+
+// Bucket of hash value h in table t. The shard index is divided out first,
+// otherwise every entry in a shard would share the same residue.
+static CacheEntry **cache_bucket(Cache *cache, CacheTable *t, unsigned long h) {
+	return &t->buckets[(h / cache->nr_shards) & (t->capacity - 1)];
+}
+
+static void table_init(CacheTable *t, unsigned long capacity) {
+	CacheEntry **buckets = (CacheEntry **) calloc(capacity, sizeof(CacheEntry *));
+	assert(buckets);
+	__atomic_store_n(&t->capacity, capacity, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->buckets, buckets, __ATOMIC_RELAXED);
+}
+
+static int cache_rehashing(CacheShard *shard) {
+	return shard->rehash_idx >= 0;
+}
+
+// Moves up to nr_buckets buckets from table[0] to table[1], finishing the
+// resize once table[0] is empty. Visits a bounded number of empty buckets
+// so that no single call takes long.
+static void cache_rehash_step(Cache *cache, CacheShard *shard, int nr_buckets) {
+	int empty_visits = nr_buckets * 10;
+	CacheTable *from = &shard->table[0];
+
+	if (!cache_rehashing(shard))
+		return;
+	shard_seq_begin(shard);
+	while (nr_buckets > 0 && shard->rehash_idx < from->capacity) {
+		CacheEntry *entry = from->buckets[shard->rehash_idx];
+		if (entry == NULL) {
+			shard->rehash_idx++;
+			if (--empty_visits == 0)
+				break;
+			continue;
+		}
+		while (entry != NULL) {
+			CacheEntry *next = entry->next;
+			CacheEntry **bucket = cache_bucket(cache, &shard->table[1], entry->hash);
+			__atomic_store_n(&entry->next, *bucket, __ATOMIC_RELAXED);
+			__atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+			entry = next;
+		}
+		__atomic_store_n(&from->buckets[shard->rehash_idx++], NULL, __ATOMIC_RELAXED);
+		nr_buckets--;
+	}
+	if (shard->rehash_idx == from->capacity) {
+		epoch_retire(cache->epoch, from->buckets, free);
+		__atomic_store_n(&from->buckets, shard->table[1].buckets, __ATOMIC_RELAXED);
+		__atomic_store_n(&from->capacity, shard->table[1].capacity, __ATOMIC_RELAXED);
+		__atomic_store_n(&shard->table[1].buckets, NULL, __ATOMIC_RELAXED);
+		__atomic_store_n(&shard->table[1].capacity, 0, __ATOMIC_RELAXED);
+		shard->rehash_idx = -1;
+	}
+	shard_seq_end(shard);
+}
+
+// Starts a resize when the table is more than full or less than an eighth
+// full
+static void cache_maybe_resize(CacheShard *shard) {
+	unsigned long capacity = shard->table[0].capacity;
+
+	if (cache_rehashing(shard))
+		return;
+	if (shard->nr_entries > capacity)
+		capacity *= 2;
+	else if (capacity > CACHE_MIN_CAPACITY && shard->nr_entries < capacity / 8)
+		capacity /= 2;
+	else
+		return;
+	shard_seq_begin(shard);
+	table_init(&shard->table[1], capacity);
+	shard->rehash_idx = 0;
+	shard_seq_end(shard);
+}
+
+// Finds the link pointing at the entry for filename, or at the end of its
+// chain if there is none. Comparing the stored hash first skips the strcmp
+// for nearly every other entry in the chain.
+static CacheEntry **cache_find(Cache *cache, CacheShard *shard, unsigned long h, char *filename) {
+	CacheEntry **link = NULL;
+	int nr_tables = cache_rehashing(shard) ? 2 : 1;
+
+	for (int i=0; i<nr_tables; ++i) {
+		link = cache_bucket(cache, &shard->table[i], h);
+		while (*link != NULL) {
+			CacheEntry *entry = *link;
+			if (entry->hash == h && !strcmp(entry->data->file_name, filename))
+				return link;
+			link = &entry->next;
+		}
+	}
+	// New entries go into table[1] while rehashing
+	return link;
+}
+
+// Like cache_find, but without the lock, so it must be called inside an
+// epoch. Returns the entry for filename, or NULL on a miss. Sets *retry if
+// the tables changed during the walk, so that the miss may be wrong.
+static CacheEntry *cache_find_lockless(Cache *cache, CacheShard *shard, unsigned long h, char *filename, int *retry) {
+	unsigned long seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+	CacheTable tables[2];
+	int nr_tables = 0;
+
+	*retry = 1;
+	if (seq & 1)
+		return NULL;
+	for (int i=0; i<2; ++i) {
+		tables[i].buckets = __atomic_load_n(&shard->table[i].buckets, __ATOMIC_RELAXED);
+		tables[i].capacity = __atomic_load_n(&shard->table[i].capacity, __ATOMIC_RELAXED);
+		if (tables[i].buckets)
+			nr_tables++;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq)
+		return NULL;
+
+	for (int i=0; i<nr_tables; ++i) {
+		CacheEntry *entry = __atomic_load_n(cache_bucket(cache, &tables[i], h), __ATOMIC_ACQUIRE);
+		while (entry != NULL) {
+			if (entry->hash == h && !strcmp(entry->data->file_name, filename)) {
+				*retry = 0;
+				return entry;
+			}
+			entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE);
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	*retry = __atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq;
+	return NULL;
+}
+
+// Reports a counted hit to the policy. An entry found without the lock may
+// have been evicted since, and is then no longer on the policy's lists.
+static void cache_hit(Cache *cache, CacheShard *shard, CacheEntry *entry) {
+	long hits = __atomic_add_fetch(&entry->hits, 1, __ATOMIC_RELAXED);
+
+	if (cache->policy->lockless_hit) {
+		cache->policy->hit(shard->policy_state, entry);
+	} else if ((hits - 1) % CACHE_HIT_SAMPLE == 0 &&
+		   pthread_mutex_trylock(&shard->lru_lock) == 0) {
+		if (!entry->evicted)
+			cache->policy->hit(shard->policy_state, entry);
+		pthread_mutex_unlock(&shard->lru_lock);
+	}
+}
+
+// Returns the cached data for filename with a reference held for the caller.
+// Only a counted lookup is a request for the file, which the hit count and
+// the eviction policy see. The entry cannot be freed before epoch_exit, and
+// the cache's own reference to its data is only dropped when it is freed.
+static struct file_data* shard_lookup(Cache *cache, CacheShard *shard, unsigned long h, char *filename, int counted) {
+	struct file_data *ret = NULL;
+	CacheEntry *entry;
+	int retry;
+
+	epoch_enter(cache->epoch);
+	entry = cache_find_lockless(cache, shard, h, filename, &retry);
+	if (entry == NULL && retry) {
+		pthread_rwlock_rdlock(&shard->lock);
+		entry = *cache_find(cache, shard, h, filename);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+	if (entry) {
+		ret = file_data_get(entry->data);
+		if (counted)
+			cache_hit(cache, shard, entry);
+	}
+	epoch_exit(cache->epoch);
+	return ret;
+}
+
+// Returns the cached data for filename with a reference held for the caller,
+// or NULL on a miss. The caller drops the reference with file_data_put.
+struct file_data* cache_lookup(Cache *cache, char *filename) {
+	unsigned long h = hash(filename);
+	CacheShard *shard = cache_shard(cache, h);
+	if (shard->sketch)
+		sketch_increment(shard->sketch, h);
+	return shard_lookup(cache, shard, h, filename, 1);
+}
+
+// Returns 1 if filename is cached. Unlike cache_lookup, this does not count
+// as a request for the file, so it can be used to plan requests.
+int cache_contains(Cache *cache, char *filename) {
+	unsigned long h = hash(filename);
+	CacheShard *shard = cache_shard(cache, h);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	int ret = *cache_find(cache, shard, h, filename) != NULL;
+	pthread_rwlock_unlock(&shard->lock);
+	return ret;
+}
+
+// Lookups may still be walking past target, so its next link is left as it
+// is, and it is only freed once they are done.
+static void remove_from_cache(Cache *cache, CacheShard *shard, CacheEntry *target) {
+	CacheEntry **link = cache_find(cache, shard, target->hash, target->data->file_name);
+
+	assert(*link == target);
+	__atomic_store_n(link, target->next, __ATOMIC_RELEASE);
+	shard->size -= target->data->file_size;
+	shard->nr_entries--;
+	epoch_retire(cache->epoch, target, cache_entry_free);
+}
+
+static unsigned long cache_evict(Cache *cache, CacheShard *shard, unsigned long amount_to_evict) {
+	// No need for mutex as this function only called from cache_insert, which already has mutex.
+	// Entries that are still being sent are evicted too, since their
+	// senders hold their own reference to the data.
+	unsigned long evicted_amount = 0;
+	CacheEntry *victim;
+	while (evicted_amount < amount_to_evict &&
+	       (victim = cache->policy->evict(shard->policy_state)) != NULL) {
+		evicted_amount += victim->data->file_size;
+		victim->evicted = 1;
+		TRACE(TRACE_DEBUG, TRACE_EVICT, victim->data->file_size, 0,
+		      victim->data->file_name);
+		remove_from_cache(cache, shard, victim);
+		shard->nr_evictions++;
+	}
+	return evicted_amount;
+}
+
+// TinyLFU admission: a new file may only evict the entries that make room for
+// it if it is estimated to be requested more often than each of them.
+// Otherwise one scan over cold files would flush the whole working set.
+// Policies that cannot predict all the victims are only checked against the
+// ones they can.
+static int cache_admit(Cache *cache, CacheShard *shard, unsigned long h, unsigned long amount_to_evict) {
+	int freq = sketch_estimate(shard->sketch, h);
+	unsigned long amount = 0;
+	CacheEntry *victim = NULL;
+
+	while (amount < amount_to_evict &&
+	       (victim = cache->policy->victim(shard->policy_state, victim)) != NULL) {
+		if (sketch_estimate(shard->sketch, victim->hash) >= freq)
+			return 0;
+		amount += victim->data->file_size;
+	}
+	return 1;
+}
+
+// Adds file to the cache, which takes its own reference to it. Returns 1 if
+// the file was cached, and 0 otherwise.
+int cache_insert(Cache *cache, struct file_data *file) {
+	unsigned long h = hash(file->file_name);
+	CacheShard *shard = cache_shard(cache, h);
+	shard_write_lock(shard);
+
+	cache_rehash_step(cache, shard, CACHE_REHASH_STEP);
+	if (*cache_find(cache, shard, h, file->file_name) != NULL) {
+		shard_write_unlock(shard);
+		return 0;
+	}
+
+	if (file->file_size > shard->max_cache_size) {
+		// File too large. Cannot cache.
+		shard_write_unlock(shard);
+		return 0;
+	}
+
+	if (shard->size + file->file_size > shard->max_cache_size) {
+		unsigned long amount_to_evict = file->file_size - (shard->max_cache_size - shard->size);
+		if (shard->sketch && !cache_admit(cache, shard, h, amount_to_evict)) {
+			// Not popular enough to displace the victims
+			shard_write_unlock(shard);
+			return 0;
+		}
+		cache_evict(cache, shard, amount_to_evict);
+		if (shard->size + file->file_size > shard->max_cache_size) {
+			// Couldn't evict enough
+			cache_maybe_resize(shard);
+			shard_write_unlock(shard);
+			return 0;
+		}
+	}
+
+	CacheEntry *entry = (CacheEntry *) malloc(sizeof(CacheEntry));
+	assert(entry);
+	entry->data = file_data_get(file);
+	entry->hash = h;
+	entry->hits = 0;
+	entry->evicted = 0;
+	// The policy state is set up before lookups can find the entry
+	cache->policy->insert(shard->policy_state, entry);
+	// Evictions may have changed the chains, so look up the link again
+	CacheEntry **link = cache_find(cache, shard, h, file->file_name);
+	entry->next = NULL;
+	__atomic_store_n(link, entry, __ATOMIC_RELEASE);
+	shard->size += file->file_size;
+	shard->nr_entries++;
+	cache_maybe_resize(shard);
+	shard_write_unlock(shard);
+	return 1;
+}
+
+// Files larger than this never fit in their shard
+long cache_max_file_size(Cache *cache) {
+	return cache->shards[0].max_cache_size;
+}
+
+// Returns the shard, numbered from 0, that holds filename. Each shard holds
+// up to cache_max_file_size bytes.
+int cache_shard_index(Cache *cache, char *filename) {
+	return hash(filename) % cache->nr_shards;
+}
+
+static void cache_clear(CacheShard *shard) {
+	int nr_tables = cache_rehashing(shard) ? 2 : 1;
+
+	for (int t=0; t<nr_tables; ++t) {
+		for (unsigned long i=0; i<shard->table[t].capacity; ++i) {
+			CacheEntry *entry = shard->table[t].buckets[i];
+			while (entry != NULL) {
+				CacheEntry *temp = entry->next;
+				cache_entry_free(entry);
+				entry = temp;
+			}
+			shard->table[t].buckets[i] = NULL;
+		}
+	}
+	shard->nr_entries = 0;
+	shard->size = 0;
+}
+
+// Splits max_cache_size bytes evenly over nr_shards independently locked
+// shards. If admission is set, files are only cached when they are requested
+// more often than the entries they would evict. policy names the eviction
+// policy, and must be one that cache_policy_exists accepts.
+Cache *cache_init(long max_cache_size, int nr_shards, int admission, const char *policy) {
+	assert(nr_shards > 0);
+	Cache *cache = (Cache *) malloc(sizeof(Cache));
+	assert(cache);
+	cache->nr_shards = nr_shards;
+	cache->policy = cache_policy_find(policy);
+	assert(cache->policy);
+	cache->shards = (CacheShard *) malloc(nr_shards * sizeof(CacheShard));
+	assert(cache->shards);
+	cache->epoch = epoch_init();
+
+	for (int i=0; i<nr_shards; ++i) {
+		CacheShard *shard = &cache->shards[i];
+		shard->max_cache_size = max_cache_size / nr_shards;
+		table_init(&shard->table[0], CACHE_MIN_CAPACITY);
+		shard->table[1].buckets = NULL;
+		shard->table[1].capacity = 0;
+		shard->rehash_idx = -1;
+		shard->seq = 0;
+		shard->nr_entries = 0;
+		shard->size = 0;
+		shard->nr_evictions = 0;
+		pthread_rwlock_init(&shard->lock, NULL);
+		pthread_mutex_init(&shard->lru_lock, NULL);
+		shard->flights = NULL;
+		pthread_mutex_init(&shard->flight_lock, NULL);
+
+		shard->sketch = NULL;
+		if (admission) {
+			long width = shard->max_cache_size / CACHE_SKETCH_BYTES;
+			if (width < CACHE_MIN_SKETCH_WIDTH)
+				width = CACHE_MIN_SKETCH_WIDTH;
+			shard->sketch = sketch_init(width);
+		}
+
+		shard->policy_state = cache->policy->init(shard->max_cache_size);
+	}
+	return cache;
+}
+
+// Fills cs with the totals over all shards
+void cache_stats(Cache *cache, struct cache_stats *cs) {
+	cs->nr_entries = 0;
+	cs->size = 0;
+	cs->max_size = 0;
+	cs->nr_evictions = 0;
+	for (int i=0; i<cache->nr_shards; ++i) {
+		CacheShard *shard = &cache->shards[i];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		cs->nr_entries += shard->nr_entries;
+		cs->size += shard->size;
+		cs->max_size += shard->max_cache_size;
+		cs->nr_evictions += shard->nr_evictions;
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+int cache_policy_exists(const char *policy) {
+	return cache_policy_find(policy) != NULL;
+}
+
+void cache_destroy(Cache *cache) {
+	if (cache == NULL)
+		return;
+	for (int i=0; i<cache->nr_shards; ++i) {
+		CacheShard *shard = &cache->shards[i];
+		cache_clear(shard);
+		cache->policy->destroy(shard->policy_state);
+		free(shard->table[0].buckets);
+		free(shard->table[1].buckets);
+		assert(shard->flights == NULL);
+		pthread_rwlock_destroy(&shard->lock);
+		pthread_mutex_destroy(&shard->lru_lock);
+		pthread_mutex_destroy(&shard->flight_lock);
+		if (shard->sketch)
+			sketch_destroy(shard->sketch);
+	}
+	epoch_destroy(cache->epoch);
+	free(cache->shards);
+	free(cache);
+}
+
+struct hot_file {
+	long rank;	// Position in its shard, 0 for the next entry to evict
+	long hits;
+	CacheEntry *entry;
+	struct file_data *data;
+};
+
+static int hot_file_hits_cmp(const void *a, const void *b) {
+	long x = ((const struct hot_file *)a)->hits;
+	long y = ((const struct hot_file *)b)->hits;
+	return x < y ? -1 : x > y;
+}
+
+// Hottest last. Ranks interleave the shards, so that the order within each
+// shard is kept when the files are inserted in this order again.
+static int hot_file_cmp(const void *a, const void *b) {
+	const struct hot_file *x = a, *y = b;
+	if (x->rank != y->rank)
+		return x->rank < y->rank ? -1 : 1;
+	return hot_file_hits_cmp(a, b);
+}
+
+// Ranks the nr entries of a shard, which start at hot, in the order the
+// policy would evict them. Entries of policies that cannot tell the whole
+// order are ranked by their hits instead.
+static void cache_rank(Cache *cache, CacheShard *shard, struct hot_file *hot, long nr) {
+	CacheEntry *victim = NULL;
+	long i, nr_victims = 0;
+
+	while (nr_victims <= nr &&
+	       (victim = cache->policy->victim(shard->policy_state, victim)) != NULL)
+		nr_victims++;
+	if (nr_victims != nr) {
+		qsort(hot, nr, sizeof(struct hot_file), hot_file_hits_cmp);
+		for (i=0; i<nr; ++i)
+			hot[i].rank = i;
+		return;
+	}
+	for (i=0; i<nr; ++i) {
+		victim = cache->policy->victim(shard->policy_state, i ? hot[i-1].entry : NULL);
+		hot[i].rank = i;
+		hot[i].hits = __atomic_load_n(&victim->hits, __ATOMIC_RELAXED);
+		hot[i].entry = victim;
+	}
+}
+
+// Returns the number of cached files, and sets *files to an array of them
+// in the order the cache would evict them, the hottest last. The caller owns
+// the array, and a reference to each file that it drops with file_data_put.
+long cache_files(Cache *cache, struct file_data ***files) {
+	struct hot_file *hot = NULL;
+	long nr_files = 0, max_files = 0;
+
+	for (int i=0; i<cache->nr_shards; ++i) {
+		CacheShard *shard = &cache->shards[i];
+		long first = nr_files;
+		int nr_tables;
+
+		// With lru_lock, since walking the policy order races with hits
+		shard_write_lock(shard);
+		nr_tables = cache_rehashing(shard) ? 2 : 1;
+		for (int t=0; t<nr_tables; ++t) {
+			for (unsigned long b=0; b<shard->table[t].capacity; ++b) {
+				CacheEntry *entry;
+				for (entry = shard->table[t].buckets[b]; entry; entry = entry->next) {
+					if (nr_files == max_files) {
+						max_files = max_files ? max_files * 2 : 64;
+						hot = realloc(hot, max_files * sizeof(struct hot_file));
+						assert(hot);
+					}
+					hot[nr_files].hits = __atomic_load_n(&entry->hits, __ATOMIC_RELAXED);
+					hot[nr_files].entry = entry;
+					nr_files++;
+				}
+			}
+		}
+		cache_rank(cache, shard, hot + first, nr_files - first);
+		for (long f=first; f<nr_files; ++f)
+			hot[f].data = file_data_get(hot[f].entry->data);
+		shard_write_unlock(shard);
+	}
+
+	qsort(hot, nr_files, sizeof(struct hot_file), hot_file_cmp);
+	*files = (struct file_data **) malloc((nr_files ? nr_files : 1) * sizeof(struct file_data *));
+	assert(*files);
+	for (long i=0; i<nr_files; ++i)
+		(*files)[i] = hot[i].data;
+	free(hot);
+	return nr_files;
+}
+
+// Writes the names of the cached files to path, one per line, the hottest
+// first, so that a later run can warm up its cache with the files that
+// were hot in this one. The names are written as they are requested, without
+// the leading "./". Returns 0 if path could not be written.
+int cache_save(Cache *cache, const char *path) {
+	struct file_data **files;
+	long nr_files;
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL)
+		return 0;
+	nr_files = cache_files(cache, &files);
+	for (long i=nr_files-1; i>=0; --i) {
+		char *name = files[i]->file_name;
+		if (!strncmp(name, "./", 2))
+			name += 2;
+		fprintf(f, "%s\n", name);
+		file_data_put(files[i]);
+	}
+	free(files);
+	return fclose(f) == 0;
+}
+
+// ======================== End of Hashtable Operations ========================
+
+// ======================== Single-flight Misses ========================
+
+// Coalesces concurrent misses on the same file, after cache_lookup missed.
+//
+// On the first miss, returns NULL and sets *flight: the caller must read the
+// file and then call cache_fetch_done. Later misses on the same file wait
+// for that read, set *waited, and return its data. If the read failed, they
+// return NULL with *flight set to NULL, and the caller reads the file itself
+// so it can report the error. If the file was cached since the lookup,
+// returns it with *flight set to NULL.
+struct file_data* cache_fetch(Cache *cache, char *filename, CacheFlight **flight, int *waited) {
+	unsigned long h = hash(filename);
+	CacheShard *shard = cache_shard(cache, h);
+	struct file_data *ret;
+	CacheFlight *current;
+
+	*flight = NULL;
+	*waited = 0;
+	pthread_mutex_lock(&shard->flight_lock);
+	for (current = shard->flights; current != NULL; current = current->next) {
+		if (current->hash == h && !strcmp(current->file_name, filename))
+			break;
+	}
+	if (current) {
+		// Wait for the read that is already in flight
+		*waited = 1;
+		current->nr_waiters++;
+		while (!current->done)
+			pthread_cond_wait(&current->cv, &shard->flight_lock);
+		ret = current->data ? file_data_get(current->data) : NULL;
+		if (--current->nr_waiters == 0) {
+			if (current->data)
+				file_data_put(current->data);
+			pthread_cond_destroy(&current->cv);
+			free(current);
+		}
+		pthread_mutex_unlock(&shard->flight_lock);
+		return ret;
+	}
+
+	// The file may have been inserted by a read that finished after the
+	// lookup. The lookup already counted this request.
+	ret = shard_lookup(cache, shard, h, filename, 0);
+	if (ret == NULL) {
+		current = (CacheFlight *) malloc(sizeof(CacheFlight));
+		assert(current);
+		current->hash = h;
+		current->file_name = filename;
+		current->data = NULL;
+		current->done = 0;
+		current->nr_waiters = 0;
+		pthread_cond_init(&current->cv, NULL);
+		current->next = shard->flights;
+		shard->flights = current;
+		*flight = current;
+	}
+	pthread_mutex_unlock(&shard->flight_lock);
+	return ret;
+}
+
+// Completes a read started by cache_fetch. data is the file that was read,
+// or NULL if it could not be read. Inserts the file into the cache, then
+// hands it to every request waiting on the flight. Returns 1 if the file was
+// cached, and 0 otherwise.
+int cache_fetch_done(Cache *cache, CacheFlight *flight, struct file_data *data) {
+	CacheShard *shard = cache_shard(cache, flight->hash);
+	CacheFlight **link;
+	int inserted = 0;
+
+	if (data)
+		inserted = cache_insert(cache, data);
+
+	pthread_mutex_lock(&shard->flight_lock);
+	for (link = &shard->flights; *link != flight; link = &(*link)->next)
+		assert(*link != NULL);
+	*link = flight->next;
+	flight->file_name = NULL;
+	flight->done = 1;
+	if (flight->nr_waiters > 0) {
+		// The last waiter to wake up frees the flight
+		flight->data = data ? file_data_get(data) : NULL;
+		pthread_cond_broadcast(&flight->cv);
+	} else {
+		pthread_cond_destroy(&flight->cv);
+		free(flight);
+	}
+	pthread_mutex_unlock(&shard->flight_lock);
+	return inserted;
+}
+
+// ======================== End of Single-flight Misses ========================
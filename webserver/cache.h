@@ -0,0 +1,33 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+struct file_data;
+
+typedef struct cache Cache;
+typedef struct cache_flight CacheFlight;
+
+struct cache_stats {
+	long nr_entries;
+	long size;		/* bytes cached */
+	long max_size;
+	long nr_evictions;
+};
+
+Cache *cache_init(long max_cache_size, int nr_shards, int admission,
+		  const char *policy);
+int cache_policy_exists(const char *policy);
+struct file_data *cache_lookup(Cache *cache, char *filename);
+int cache_contains(Cache *cache, char *filename);
+int cache_insert(Cache *cache, struct file_data *file);
+long cache_max_file_size(Cache *cache);
+int cache_shard_index(Cache *cache, char *filename);
+void cache_stats(Cache *cache, struct cache_stats *cs);
+long cache_files(Cache *cache, struct file_data ***files);
+int cache_save(Cache *cache, const char *path);
+struct file_data *cache_fetch(Cache *cache, char *filename,
+			      CacheFlight **flight, int *waited);
+int cache_fetch_done(Cache *cache, CacheFlight *flight,
+		     struct file_data *data);
+void cache_destroy(Cache *cache);
+
+#endif /* __CACHE_H__ */
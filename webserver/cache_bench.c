@@ -0,0 +1,313 @@
+/*
+ * cache_bench.c: Microbenchmarks for the web server file cache.
+ *
+ * To run:
+ *  cache_bench [-l nr_lookups] [-s nr_shards] [-t max_threads]
+ *              [-r nr_requests] [-c cache_size]
+ *
+ * First fills the cache with 1k to 1M small entries and reports the average
+ * cost of a cache hit (lookup followed by dropping the reference) at each
+ * size. Since the hash table grows with the number of entries, the hit cost
+ * should stay flat as the cache grows.
+ *
+ * Then reports hit throughput as the number of threads doubles up to
+ * max_threads, once with a single cache shard and once with nr_shards shards.
+ *
+ * Finally replays nr_requests requests over a simulated fileset with the same
+ * file sizes as the fileset program, through a cache of cache_size bytes, and
+ * reports the hit ratio and byte hit ratio of each eviction policy, with and
+ * without the admission filter, under uniform, self-similar and Pareto
+ * request distributions. Every policy sees the same request sequence.
+ */
+
+#include <popt.h>
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+
+poptContext context;	/* context for parsing command-line options */
+
+#define DEFAULT_NR_LOOKUPS 1000000
+#define DEFAULT_NR_SHARDS 16
+#define DEFAULT_MAX_THREADS 32
+/* number of entries used for the throughput runs */
+#define THREADS_NR_ENTRIES 10000
+#define DEFAULT_NR_REQUESTS 200000
+#define DEFAULT_CACHE_SIZE 1048576
+/* same defaults as the fileset program */
+#define SIM_MEAN_FILE_SZ 3
+#define SIM_NR_FILES 256
+/* seed for the request sequence of each replay */
+#define SIM_SEED 344
+
+static int nr_lookups = DEFAULT_NR_LOOKUPS;
+static int nr_shards = DEFAULT_NR_SHARDS;
+static int max_threads = DEFAULT_MAX_THREADS;
+static int nr_requests = DEFAULT_NR_REQUESTS;
+static int cache_size = DEFAULT_CACHE_SIZE;
+
+struct bench {
+	Cache *cache;
+	char **names;
+	int nr_entries;
+	int nr_lookups;
+};
+
+static struct bench *
+bench_init(int nr_entries, int shards)
+{
+	struct bench *b = Malloc(sizeof(struct bench));
+	char name[MAXLINE];
+	int i, ret;
+
+	/* give every shard room for all entries so that no insert fails */
+	b->cache = cache_init((long)nr_entries * shards, shards, 0, "lru");
+	b->names = Malloc(nr_entries * sizeof(char *));
+	b->nr_entries = nr_entries;
+	for (i = 0; i < nr_entries; i++) {
+		struct file_data *data = file_data_init();
+		snprintf(name, MAXLINE, "./fileset_dir/%07d", i);
+		data->file_name = strdup(name);
+		data->file_size = 1;
+		b->names[i] = data->file_name;
+		ret = cache_insert(b->cache, data);
+		assert(ret);
+		file_data_put(data);
+	}
+	return b;
+}
+
+static void
+bench_destroy(struct bench *b)
+{
+	/* names are owned by the cached file data */
+	cache_destroy(b->cache);
+	free(b->names);
+	free(b);
+}
+
+/* random() takes a lock, so each thread uses its own xorshift generator */
+static unsigned int
+bench_rand(unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void *
+bench_hits(void *arg)
+{
+	struct bench *b = arg;
+	unsigned int state = (unsigned int)random() | 1;
+	int i;
+
+	for (i = 0; i < b->nr_lookups; i++) {
+		char *name = b->names[bench_rand(&state) % b->nr_entries];
+		struct file_data *data = cache_lookup(b->cache, name);
+		assert(data);
+		file_data_put(data);
+	}
+	return NULL;
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval end, diff;
+
+	gettimeofday(&end, NULL);
+	timersub(&end, start, &diff);
+	return (double)diff.tv_sec + (double)diff.tv_usec / 1000000;
+}
+
+/* average ns per hit with a single thread */
+static double
+bench_latency(int nr_entries)
+{
+	struct bench *b = bench_init(nr_entries, nr_shards);
+	struct timeval start;
+	double secs;
+
+	b->nr_lookups = nr_lookups;
+	gettimeofday(&start, NULL);
+	bench_hits(b);
+	secs = elapsed(&start);
+	bench_destroy(b);
+	return secs * 1e9 / nr_lookups;
+}
+
+/* millions of hits per second over all threads */
+static double
+bench_throughput(int shards, int nr_threads)
+{
+	struct bench *b = bench_init(THREADS_NR_ENTRIES, shards);
+	pthread_t *threads = Malloc(nr_threads * sizeof(pthread_t));
+	struct timeval start;
+	double secs, mhits;
+	int i;
+
+	b->nr_lookups = nr_lookups / nr_threads;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		SYS(pthread_create(&threads[i], NULL, bench_hits, b));
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	secs = elapsed(&start);
+	mhits = (double)b->nr_lookups * nr_threads / secs / 1e6;
+	free(threads);
+	bench_destroy(b);
+	return mhits;
+}
+
+enum sim_dist { SIM_UNIFORM, SIM_SELF_SIMILAR, SIM_PARETO };
+static const char *sim_dist_names[] = { "uniform", "self-similar", "pareto" };
+static const char *sim_policies[] = { "lru", "clock", "arc", "s3fifo", "gds" };
+
+struct sim {
+	int nr_files;
+	int *sizes;
+};
+
+/* uses the file sizes of the fileset program */
+static void
+sim_init(struct sim *sim)
+{
+	sim->nr_files = fileset_sizes(SIM_MEAN_FILE_SZ, SIM_NR_FILES,
+				      &sim->sizes);
+	init_random();
+}
+
+/* returns a file number >= 0 and < nr_files */
+static int
+sim_next(struct sim *sim, enum sim_dist dist)
+{
+	double x;
+
+	switch (dist) {
+	case SIM_SELF_SIMILAR:
+		return rand_self_similar_int(0.2, sim->nr_files) - 1;
+	case SIM_PARETO:
+		/* as rand_pareto_int, drawing again past the last file */
+		do {
+			x = rand_pareto(1, 0.5);
+		} while (x >= sim->nr_files + 0.5);
+		return round(x) - 1;
+	default:
+		return rand_int(sim->nr_files) - 1;
+	}
+}
+
+/* prints hit ratio and byte hit ratio for one replay */
+static void
+sim_run(struct sim *sim, enum sim_dist dist, const char *policy,
+	int admission)
+{
+	Cache *cache = cache_init(cache_size, 1, admission, policy);
+	char name[MAXLINE];
+	long hits = 0, bytes = 0, hit_bytes = 0;
+	int i;
+
+	srandom(SIM_SEED);
+
+	for (i = 0; i < nr_requests; i++) {
+		int fnr = sim_next(sim, dist);
+		struct file_data *data;
+
+		snprintf(name, MAXLINE, "./fileset_dir/%05d", fnr);
+		bytes += sim->sizes[fnr];
+		data = cache_lookup(cache, name);
+		if (data) {
+			hits++;
+			hit_bytes += sim->sizes[fnr];
+		} else {
+			data = file_data_init();
+			data->file_name = strdup(name);
+			data->file_size = sim->sizes[fnr];
+			cache_insert(cache, data);
+		}
+		file_data_put(data);
+	}
+	cache_destroy(cache);
+	printf(", %.4f, %.4f", (double)hits / nr_requests,
+	       (double)hit_bytes / bytes);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	int c, nr_entries, nr_threads;
+	struct sim sim;
+	enum sim_dist dist;
+	int p;
+
+	struct poptOption options_table[] = {
+		{NULL, 'l', POPT_ARG_INT, &nr_lookups, 'l',
+		 "number of lookups per measurement",
+		 " default: " STR(DEFAULT_NR_LOOKUPS)},
+		{NULL, 's', POPT_ARG_INT, &nr_shards, 's',
+		 "number of cache shards",
+		 " default: " STR(DEFAULT_NR_SHARDS)},
+		{NULL, 't', POPT_ARG_INT, &max_threads, 't',
+		 "maximum number of threads",
+		 " default: " STR(DEFAULT_MAX_THREADS)},
+		{NULL, 'r', POPT_ARG_INT, &nr_requests, 'r',
+		 "number of requests per hit ratio replay",
+		 " default: " STR(DEFAULT_NR_REQUESTS)},
+		{NULL, 'c', POPT_ARG_INT, &cache_size, 'c',
+		 "cache size in bytes for the hit ratio replays",
+		 " default: " STR(DEFAULT_CACHE_SIZE)},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	if (nr_lookups <= 0 || nr_shards <= 0 || max_threads <= 0 ||
+	    nr_requests <= 0 || cache_size <= 0) {
+		poptPrintUsage(context, stderr, 0);
+		exit(1);
+	}
+
+	init_random();
+
+	printf("entries, ns per hit\n");
+	for (nr_entries = 1000; nr_entries <= 1000000; nr_entries *= 10) {
+		printf("%d, %.1f\n", nr_entries, bench_latency(nr_entries));
+		fflush(stdout);
+	}
+
+	printf("\nthreads, Mhits/s with 1 shard, Mhits/s with %d shards\n",
+	       nr_shards);
+	for (nr_threads = 1; nr_threads <= max_threads; nr_threads *= 2) {
+		printf("%d, %.2f, %.2f\n", nr_threads,
+		       bench_throughput(1, nr_threads),
+		       bench_throughput(nr_shards, nr_threads));
+		fflush(stdout);
+	}
+
+	sim_init(&sim);
+	printf("\ndistribution, policy, hit ratio, byte hit ratio, "
+	       "hit ratio with admission, byte hit ratio with admission\n");
+	for (dist = SIM_UNIFORM; dist <= SIM_PARETO; dist++) {
+		for (p = 0; p < sizeof(sim_policies) / sizeof(char *); p++) {
+			printf("%s, %s", sim_dist_names[dist], sim_policies[p]);
+			sim_run(&sim, dist, sim_policies[p], 0);
+			sim_run(&sim, dist, sim_policies[p], 1);
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+	free(sim.sizes);
+	exit(0);
+}
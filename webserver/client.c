@@ -1,40 +1,77 @@
 /*
  * client.c: A multi-threaded client for testing the HTTP server.
- * 
+ *
+ * By default the client is closed-loop: each thread sends its next request
+ * once the last one is done, so a slow server also slows down the load,
+ * and the time requests would have waited is never measured. With -r, the
+ * client is open-loop instead. Requests are due at a fixed rate, evenly
+ * spaced or, with -p, as Poisson arrivals, and the threads send each one
+ * when it is due. The latency of a request counts from when it was due, so
+ * requests that wait for a free thread count the wait as well. Use enough
+ * threads for the rate, otherwise the client itself becomes the queue.
+ *
+ * Files are picked with a uniform distribution by default. With -d, they
+ * can follow a Zipf distribution instead, where the k-th file is requested
+ * in proportion to 1 / k^s, or the self-similar or Pareto distributions.
+ * Every run prints its distribution and seed, and -s repeats a run's file
+ * choices and open-loop schedule: each closed-loop thread draws its files
+ * from its own generator, and the open-loop schedule is drawn up front.
+ *
+ * With -R, the client replays an access log that the server recorded with
+ * -R, open-loop, sending each request after the same delay from the first
+ * one as when it was recorded, or -x times sooner. The log is replayed
+ * nr_times times, back to back. Requests for files in the fileset are sent
+ * as they are. Other files, as in a log recorded on another server, are
+ * mapped to the fileset files that the log does not ask for, in the order
+ * in which they first show up, so the replay requests the same number of
+ * distinct files, in the same sequence, as far as the fileset goes.
  */
 
+/* for tdestroy */
+#define _GNU_SOURCE
+
+#include <search.h>
 #include "common.h"
+#include "access_log.h"
 
-/* send an HTTP request for the specified file */
+/* send an HTTP request for the specified file. HTTP/1.1 connections are
+ * kept open by the server */
 static void
-client_send(int fd, char *host, char *filename)
+client_send(int fd, char *host, char *filename, int keep_alive)
 {
 	char buf[MAXLINE];
+	int n;
 
 	/* create the request line */
-	sprintf(buf, "GET %s HTTP/1.0\r\n", filename);
+	n = sprintf(buf, "GET %s HTTP/1.%d\r\n", filename, keep_alive);
 	/* create one request header line for the server host, 
 	   and then the empty line */
-	sprintf(buf, "%shost: %s\r\n\r\n", buf, host);
+	sprintf(buf + n, "host: %s\r\n\r\n", host);
 	Rio_write(fd, buf, strlen(buf));
 }
 
-/* read the HTTP response and print it out */
-static void
-client_print(int fd, unsigned int orig_csum, int orig_length, int print)
+/* read the HTTP response and print it out. on a persistent connection, the
+ * body is exactly Content-Length bytes, otherwise it ends when the server
+ * closes the connection. returns 0 if the server closed the connection
+ * without responding, 2 if it was too busy to serve the request, and 1
+ * otherwise. */
+static int
+client_print(struct rio *rio, unsigned int orig_csum, int orig_length,
+	     int print, int keep_alive)
 {
-	struct rio *rio;
 	char buf[MAXBUF];
 	int i, n;
+	int status = 0;
 	int length = 0;
 	int length_received = 0;
 	unsigned int csum = 0;
 	unsigned int csum_received = 0;
-	
-	rio = Rio_init(fd);
 
 	/* read and display the HTTP header */
 	n = Rio_readlineb(rio, buf, MAXBUF);
+	if (n == 0)
+		return 0;
+	sscanf(buf, "HTTP/%*s %d", &status);
 	while (strcmp(buf, "\r\n") && (n > 0)) {
 		if (print) {
 			printf("Header: %s", buf);
@@ -51,9 +88,19 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 	}
 
 	fflush(stdout);
+	if (status == 503) {
+		/* the server is overloaded and closes the connection. the
+		 * response has no body */
+		return 2;
+	}
 	/* read and display the HTTP body */
 	do {
-		n = Rio_readlineb(rio, buf, MAXBUF);
+		if (keep_alive) {
+			n = length - length_received;
+			n = Rio_readnb(rio, buf, n < MAXBUF ? n : MAXBUF);
+		} else {
+			n = Rio_readlineb(rio, buf, MAXBUF);
+		}
 		if (print) {
 			Rio_write(STDOUT_FILENO, buf, n);
 		}
@@ -68,7 +115,7 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 
 	assert(length == length_received);
 	assert(csum == csum_received);
-	Rio_destroy(rio);
+	return 1;
 }
 
 struct fileinfo {
@@ -77,6 +124,35 @@ struct fileinfo {
 	int len;
 };
 
+enum popularity_dist {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_SELF_SIMILAR,
+	DIST_PARETO,
+	NR_DISTS
+};
+
+static const char *dist_names[NR_DISTS] = {
+	"uniform", "zipf", "self-similar", "pareto"
+};
+
+/* the parameter each distribution takes when -d does not give one: the
+ * Zipf exponent, the self-similar fraction, such that a fraction 1 - h of
+ * the requests go to a fraction h of the files, and the Pareto shape. the
+ * Pareto tail wraps around the file set, as in cache_bench. */
+static const double dist_defaults[NR_DISTS] = { 0, 1.0, 0.2, 0.5 };
+
+/* how files are picked. a Zipf distribution is sampled with Vose's alias
+ * method: file i is picked with probability prob[i] when its slot comes
+ * up, and alias[i] otherwise, so a pick takes constant time. */
+struct popularity {
+	enum popularity_dist dist;
+	double param;
+	int nr_files;
+	double *prob;
+	int *alias;
+};
+
 struct client {
 	char *host;
 	int port;
@@ -85,44 +161,507 @@ struct client {
 	struct fileinfo *fileset;
 	int nr_files;
 	int timing_mode;
+	int keep_alive;	/* send all requests over one connection per thread */
+	struct popularity pop;
+	int seed;
+	int nr_started;		/* threads that have drawn their seeds */
+	double *latencies;	/* ms from sending each request to the end of
+				 * its response, in timing mode */
+	int nr_latencies;
+	int nr_rejected;	/* requests the server was too busy to serve */
+
+	/* open-loop mode */
+	int open_loop;
+	int nr_requests;	/* over all threads */
+	double rate;		/* requests per second, or 0 when closed-loop */
+	int poisson;		/* arrivals are Poisson rather than evenly
+				 * spaced */
+	double interval;	/* seconds between the reported intervals */
+	double start;		/* in ms */
+	char *replay;		/* the access log being replayed, if any */
+	double speed;		/* how many times faster than recorded */
+	double *due;		/* ms from start until each request is due */
+	int *files;		/* the file of each request */
+	int next;		/* the next request to send */
+	int nr_late;		/* requests sent over CLIENT_LATE_MS late */
 };
 
-/* open a single connection to the specified host and port */
+/* an open-loop request sent later than this, in ms, was held up by the
+ * client rather than by the server */
+#define CLIENT_LATE_MS 1.0
+#define DEFAULT_INTERVAL 1.0
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+sleep_until_ms(double ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms - ts.tv_sec * 1000.0) * 1000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the value at or below which a fraction q of the n sorted values lie */
+static double
+percentile(double *sorted, int n, double q)
+{
+	int i = ceil(q * n) - 1;
+
+	if (n == 0)
+		return 0;
+	return sorted[i < 0 ? 0 : i];
+}
+
+static void
+print_percentiles(double *sorted, int n)
+{
+	printf("p50 = %.3f ms, p90 = %.3f ms, p99 = %.3f ms, "
+	       "p99.9 = %.3f ms, max = %.3f ms\n", percentile(sorted, n, 0.5),
+	       percentile(sorted, n, 0.9), percentile(sorted, n, 0.99),
+	       percentile(sorted, n, 0.999), n ? sorted[n - 1] : 0);
+}
+
+/* builds the alias table for a Zipf distribution with exponent s */
+static void
+popularity_zipf(struct popularity *pop, double s)
+{
+	int n = pop->nr_files;
+	int *small = Malloc(sizeof(int) * n);
+	int *large = Malloc(sizeof(int) * n);
+	int nr_small = 0, nr_large = 0, i, l;
+	double sum = 0;
+
+	pop->prob = Malloc(sizeof(double) * n);
+	pop->alias = Malloc(sizeof(int) * n);
+	for (i = 0; i < n; i++) {
+		sum += pow(i + 1, -s);
+	}
+	/* scale so that the average slot holds 1 */
+	for (i = 0; i < n; i++) {
+		pop->prob[i] = pow(i + 1, -s) * n / sum;
+		pop->alias[i] = i;
+		if (pop->prob[i] < 1)
+			small[nr_small++] = i;
+		else
+			large[nr_large++] = i;
+	}
+	/* fill each slot that holds less than 1 with part of a file that
+	 * holds more */
+	while (nr_small > 0 && nr_large > 0) {
+		i = small[--nr_small];
+		l = large[nr_large - 1];
+		pop->alias[i] = l;
+		pop->prob[l] -= 1 - pop->prob[i];
+		if (pop->prob[l] < 1) {
+			nr_large--;
+			small[nr_small++] = l;
+		}
+	}
+	/* what is left holds 1, give or take rounding */
+	while (nr_large > 0)
+		pop->prob[large[--nr_large]] = 1;
+	while (nr_small > 0)
+		pop->prob[small[--nr_small]] = 1;
+	free(small);
+	free(large);
+}
+
+/* parses a distribution given as name[:param]. returns 0 if there is no
+ * such distribution, or the parameter is out of range. */
+static int
+popularity_init(struct popularity *pop, char *arg, int nr_files)
+{
+	char *param = strchr(arg, ':');
+	int len = param ? param - arg : strlen(arg);
+
+	for (pop->dist = 0; pop->dist < NR_DISTS; pop->dist++) {
+		if (strlen(dist_names[pop->dist]) == len &&
+		    strncmp(arg, dist_names[pop->dist], len) == 0)
+			break;
+	}
+	if (pop->dist == NR_DISTS)
+		return 0;
+	pop->param = param ? atof(param + 1) : dist_defaults[pop->dist];
+	pop->nr_files = nr_files;
+	pop->prob = NULL;
+	pop->alias = NULL;
+	switch (pop->dist) {
+	case DIST_ZIPF:
+		if (pop->param <= 0)
+			return 0;
+		popularity_zipf(pop, pop->param);
+		break;
+	case DIST_SELF_SIMILAR:
+		if (pop->param <= 0 || pop->param >= 0.5)
+			return 0;
+		break;
+	case DIST_PARETO:
+		if (pop->param <= 0)
+			return 0;
+		break;
+	default:
+		break;
+	}
+	return 1;
+}
+
+/* returns a file number >= 0 and < nr_files, given two uniform random
+ * numbers in [0, 1) */
+static int
+popularity_pick(struct popularity *pop, double u, double v)
+{
+	int n = pop->nr_files, fnr;
+	double x;
+
+	switch (pop->dist) {
+	case DIST_ZIPF:
+		fnr = u * n;
+		return v < pop->prob[fnr] ? fnr : pop->alias[fnr];
+	case DIST_SELF_SIMILAR:
+		/* as rand_self_similar_int, with 1 - u in (0, 1]. for a small
+		 * fraction the exponent is large, and the power underflows to
+		 * 0 for most draws, which is the first file */
+		fnr = ceil(n * pow(1 - u, log(pop->param) /
+				   log(1 - pop->param))) - 1;
+		return fnr < 0 ? 0 : fnr >= n ? n - 1 : fnr;
+	case DIST_PARETO:
+		/* as rand_pareto_int, but with u scaled so that the value
+		 * rounds to a file in the fileset. this draws from the same
+		 * distribution as drawing again until the value fits, so the
+		 * files past the last one do not pile up on any file */
+		x = pow(1 - u * (1 - pow(n + 0.5, -pop->param)),
+			-1 / pop->param);
+		fnr = round(x) - 1;
+		return fnr < 0 ? 0 : fnr >= n ? n - 1 : fnr;
+	default:
+		return u * n;
+	}
+}
+
+/* describes the request distribution for the summary, with its parameter
+ * if it has one */
+static const char *
+client_distribution(struct client *cl, char *buf, size_t size)
+{
+	if (cl->replay)
+		snprintf(buf, size, "replay %.2f", cl->speed);
+	else if (cl->pop.dist == DIST_UNIFORM)
+		snprintf(buf, size, "%s", dist_names[cl->pop.dist]);
+	else
+		snprintf(buf, size, "%s %.2f", dist_names[cl->pop.dist],
+			 cl->pop.param);
+	return buf;
+}
+
+static void
+popularity_destroy(struct popularity *pop)
+{
+	free(pop->prob);
+	free(pop->alias);
+}
+
+/* picks a file with the generator state xsubi */
+static int
+client_pick(struct client *cl, unsigned short xsubi[3])
+{
+	double u = erand48(xsubi);
+
+	return popularity_pick(&cl->pop, u, erand48(xsubi));
+}
+
+/* requests file fnr on *clientfd, opening a new connection if there is
+ * none, and closes the connection unless it is kept alive. returns 2 if the
+ * server was too busy to serve the request, and 1 otherwise. */
+static int
+client_fetch(struct client *cl, int fnr, int *clientfd, struct rio **rio)
+{
+	int ret, reused = *clientfd >= 0;
+
+	/* for debugging */
+	// fprintf(stderr, "requesting file: %s\n", 
+	// cl->fileset[fnr].name);
+	do {
+		if (*clientfd < 0) {
+			*clientfd = open_clientfd(cl->host, cl->port);
+			*rio = Rio_init(*clientfd);
+			reused = 0;
+		}
+		client_send(*clientfd, cl->host, cl->fileset[fnr].name,
+			    cl->keep_alive);
+		/* when timing_mode is 1, then don't print anything */
+		ret = client_print(*rio, cl->fileset[fnr].csum,
+				   cl->fileset[fnr].len,
+				   (cl->timing_mode == 0),
+				   cl->keep_alive);
+		if (ret == 0) {
+			/* the server closed an idle connection just as
+			 * the request was sent. retry on a new one */
+			assert(reused);
+			Rio_destroy(*rio);
+			SYS(close(*clientfd));
+			*clientfd = -1;
+		}
+	} while (ret == 0);
+	if (ret == 2)
+		__sync_fetch_and_add(&cl->nr_rejected, 1);
+	if (!cl->keep_alive || ret == 2 || Rio_wait(*rio, 0) != 0) {
+		/* not kept alive, or closed by the server */
+		Rio_destroy(*rio);
+		SYS(close(*clientfd));
+		*clientfd = -1;
+	}
+	return ret;
+}
+
+/* open a connection to the specified host and port per request, or a
+ * single one in keep-alive mode */
 static void *
 client_request(void *arg)
 {
 	struct client *cl = (struct client *)arg;
-	int clientfd;
+	int clientfd = -1;
+	struct rio *rio = NULL;
+	unsigned short xsubi[3];
 	int i;
 
+	/* each thread has its own generator, seeded from the run's seed */
+	xsubi[0] = cl->seed;
+	xsubi[1] = (unsigned int)cl->seed >> 16;
+	xsubi[2] = __sync_fetch_and_add(&cl->nr_started, 1);
 	for (i = 0; i < cl->nr_times; i++) {
-		int fnr;
-
-		clientfd = open_clientfd(cl->host, cl->port);
-		/* get a random file from the file set */
-		/* we used to use a self similar distribution but that allowed
-		 * using simplistic caching policies. Now we use a uniform
-		 * distribution. */
-		/* fnr = rand_self_similar_int(0.2, cl->nr_files); */
-		fnr = rand_int(cl->nr_files);		
-		fnr--;
-		/* for debugging */
-		// fprintf(stderr, "requesting file: %s\n", 
-		// cl->fileset[fnr].name);
-		client_send(clientfd, cl->host, cl->fileset[fnr].name);
-		/* when timing_mode is 1, then don't print anything */
-		client_print(clientfd, cl->fileset[fnr].csum, 
-			     cl->fileset[fnr].len, (cl->timing_mode == 0));
+		double start = now_ms();
+
+		if (client_fetch(cl, client_pick(cl, xsubi), &clientfd,
+				 &rio) != 2 &&
+		    cl->timing_mode) {
+			cl->latencies[__sync_fetch_and_add(&cl->nr_latencies,
+							   1)] =
+				now_ms() - start;
+		}
+	}
+	if (clientfd >= 0) {
+		Rio_destroy(rio);
 		SYS(close(clientfd));
 	}
 	return NULL;
 }
 
+/* sends each request when it is due. latencies are kept by request, and
+ * are -1 for requests that the server was too busy to serve */
+static void *
+client_open_loop(void *arg)
+{
+	struct client *cl = (struct client *)arg;
+	int clientfd = -1;
+	struct rio *rio = NULL;
+	double due;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&cl->next, 1)) < cl->nr_requests) {
+		due = cl->start + cl->due[i];
+		sleep_until_ms(due);
+		if (now_ms() - due > CLIENT_LATE_MS)
+			__sync_fetch_and_add(&cl->nr_late, 1);
+		if (client_fetch(cl, cl->files[i], &clientfd, &rio) == 2)
+			cl->latencies[i] = -1;
+		else
+			cl->latencies[i] = now_ms() - due;
+	}
+	if (clientfd >= 0) {
+		Rio_destroy(rio);
+		SYS(close(clientfd));
+	}
+	return NULL;
+}
+
+/* prints the latency percentiles of the requests due in each interval, and
+ * of all requests */
+static void
+print_open_loop(struct client *cl)
+{
+	int nr_requests = cl->nr_requests;
+	double *sorted = Malloc(sizeof(double) * nr_requests);
+	double end;
+	int i, n, all = 0;
+
+	for (i = 0; i < nr_requests; ) {
+		end = (floor(cl->due[i] / 1000 / cl->interval) + 1) *
+			cl->interval;
+		printf("interval %.1f s: ", end - cl->interval);
+		for (n = 0; i < nr_requests && cl->due[i] < end * 1000; i++) {
+			if (cl->latencies[i] >= 0)
+				sorted[n++] = cl->latencies[i];
+		}
+		qsort(sorted, n, sizeof(double), cmp_double);
+		printf("%d requests, ", n);
+		print_percentiles(sorted, n);
+	}
+	for (i = 0; i < nr_requests; i++) {
+		if (cl->latencies[i] >= 0)
+			sorted[all++] = cl->latencies[i];
+	}
+	qsort(sorted, all, sizeof(double), cmp_double);
+	if (cl->replay)
+		printf("replay: %s at %.1fx, ", cl->replay, cl->speed);
+	else
+		printf("open loop: %.1f requests/s %s, ", cl->rate,
+		       cl->poisson ? "poisson" : "fixed");
+	printf("%d requests, %d sent late, ", all, cl->nr_late);
+	print_percentiles(sorted, all);
+	free(sorted);
+}
+
+/* maps the file names in an access log to files of the fileset */
+struct replay_map {
+	void *files;		/* tree of struct replay_file, by name */
+	char *requested;	/* fileset files the log asks for by name */
+	int next;		/* the next fileset file to map to */
+	int nr_mapped;		/* names that are not in the fileset */
+};
+
+struct replay_file {
+	char *name;
+	int fnr;
+};
+
+static int
+replay_file_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct replay_file *)a)->name,
+		      ((const struct replay_file *)b)->name);
+}
+
+static void
+replay_file_add(struct replay_map *map, char *name, int fnr)
+{
+	struct replay_file *rf = Malloc(sizeof(struct replay_file));
+	void *found;
+
+	rf->name = strdup(name);
+	assert(rf->name);
+	rf->fnr = fnr;
+	found = tsearch(rf, &map->files, replay_file_cmp);
+	assert(found);
+}
+
+/* returns the fileset file for name, or -1 if there is none yet */
+static int
+replay_file_find(struct replay_map *map, char *name)
+{
+	struct replay_file key, **found;
+
+	key.name = name;
+	found = tfind(&key, &map->files, replay_file_cmp);
+	return found ? (*found)->fnr : -1;
+}
+
+static void
+replay_file_free(void *rf)
+{
+	free(((struct replay_file *)rf)->name);
+	free(rf);
+}
+
+/* returns the fileset file for name, mapping a name that is not in the
+ * fileset to the next file that the log does not ask for by name, once
+ * there are no such files left, to any file */
+static int
+replay_map(struct replay_map *map, struct client *cl, char *name)
+{
+	int fnr = replay_file_find(map, name);
+
+	if (fnr >= 0)
+		return fnr;
+	while (map->next < cl->nr_files && map->requested[map->next])
+		map->next++;
+	fnr = (map->next < cl->nr_files ? map->next++ : map->nr_mapped) %
+		cl->nr_files;
+	map->nr_mapped++;
+	replay_file_add(map, name, fnr);
+	return fnr;
+}
+
+/* makes the schedule out of the access log being replayed */
+static void
+client_replay(struct client *cl)
+{
+	struct access_record *records;
+	struct replay_map map;
+	double period;
+	int i, n, pass, fnr;
+
+	records = access_log_read(cl->replay, &n);
+	if (!records) {
+		perror(cl->replay);
+		exit(1);
+	}
+	if (n == 0) {
+		fprintf(stderr, "%s: no requests to replay\n", cl->replay);
+		exit(1);
+	}
+	map.files = NULL;
+	map.requested = calloc(cl->nr_files, 1);
+	assert(map.requested);
+	map.next = 0;
+	map.nr_mapped = 0;
+	for (i = 0; i < cl->nr_files; i++) {
+		replay_file_add(&map, cl->fileset[i].name, i);
+	}
+	for (i = 0; i < n; i++) {
+		if ((fnr = replay_file_find(&map, records[i].uri)) >= 0)
+			map.requested[fnr] = 1;
+	}
+
+	/* passes are as far apart as the requests are on average */
+	period = n > 1 ? records[n - 1].us / 1000.0 * n / (n - 1) : 0;
+	cl->nr_requests = n * cl->nr_times;
+	cl->due = Malloc(sizeof(double) * cl->nr_requests);
+	cl->files = Malloc(sizeof(int) * cl->nr_requests);
+	for (i = 0; i < n; i++) {
+		fnr = replay_map(&map, cl, records[i].uri);
+		for (pass = 0; pass < cl->nr_times; pass++) {
+			cl->due[pass * n + i] = (period * pass +
+				records[i].us / 1000.0) / cl->speed;
+			cl->files[pass * n + i] = fnr;
+		}
+	}
+	if (map.nr_mapped > 0) {
+		fprintf(stderr, "%s: %d files are not in the fileset, and are "
+			"mapped to files that are\n", cl->replay,
+			map.nr_mapped);
+	}
+	tdestroy(map.files, replay_file_free);
+	free(map.requested);
+	access_log_free(records, n);
+}
+
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s [-t] host port nr_times nr_threads fileset\n",
-		program);
+	fprintf(stderr, "Usage: %s [-t] [-k] [-r rate [-p] [-i interval]] "
+		"[-R access_log [-x speed]] "
+		"[-d distribution[:param]] [-s seed] "
+		"host port nr_times nr_threads fileset\n"
+		"distributions: uniform, zipf[:exponent], "
+		"self-similar[:fraction], pareto[:shape]\n", program);
 	exit(1);
 }
 
@@ -175,37 +714,123 @@ main(int argc, char *argv[])
 	pthread_t *threads;
 	struct client cl;
 	struct timeval start, end, diff;
+	char summary[64];
+	char *dist, *seed;
 
-	if (argc != 6 && argc != 7) {
-		usage(argv[0]);
+	cl.timing_mode = 0;
+	cl.keep_alive = 0;
+	cl.rate = 0;
+	cl.poisson = 0;
+	cl.interval = DEFAULT_INTERVAL;
+	cl.replay = NULL;
+	cl.speed = 1;
+	dist = "uniform";
+	seed = NULL;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-t") == 0) {
+			cl.timing_mode = 1;
+		} else if (strcmp(argv[i], "-k") == 0) {
+			cl.keep_alive = 1;
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			/* open-loop mode only reports timings */
+			cl.rate = atof(argv[++i]);
+			cl.timing_mode = 1;
+			if (cl.rate <= 0)
+				usage(argv[0]);
+		} else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+			/* so does replay */
+			cl.replay = argv[++i];
+			cl.timing_mode = 1;
+		} else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+			cl.speed = atof(argv[++i]);
+			if (cl.speed <= 0)
+				usage(argv[0]);
+		} else if (strcmp(argv[i], "-p") == 0) {
+			cl.poisson = 1;
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			cl.interval = atof(argv[++i]);
+			if (cl.interval <= 0)
+				usage(argv[0]);
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			dist = argv[++i];
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			seed = argv[++i];
+		} else {
+			usage(argv[0]);
+		}
 	}
-	i = 1;
-	if (strcmp(argv[i], "-t") == 0) {
-		cl.timing_mode = 1;
-		i++;
-	} else {
-		cl.timing_mode = 0;
+	if (argc - i != 5) {
+		usage(argv[0]);
 	}
 	cl.host = argv[i++];
 	cl.port = atoi(argv[i++]);
 	cl.nr_times = atoi(argv[i++]);
 	cl.nr_threads = atoi(argv[i++]);
 	cl.nr_files = 0;
+	cl.nr_rejected = 0;
 	filename = argv[i++];
 	if (cl.port < 1024 || cl.nr_times <= 0 || cl.nr_threads <= 0) {
 		usage(argv[0]);
 	}
+	/* a replay has its own schedule and files */
+	if (cl.replay && (cl.rate > 0 || strcmp(dist, "uniform") != 0)) {
+		usage(argv[0]);
+	}
+	cl.open_loop = cl.rate > 0 || cl.replay;
+	cl.nr_requests = cl.nr_times * cl.nr_threads;
 
 	init_fileset(filename, &cl);
+	if (!popularity_init(&cl.pop, dist, cl.nr_files)) {
+		usage(argv[0]);
+	}
 
-	if (cl.timing_mode)
-		gettimeofday(&start, NULL);
+	if (seed) {
+		cl.seed = atoi(seed);
+		srandom(cl.seed);
+	} else {
+		cl.seed = init_random();
+	}
+	cl.nr_started = 0;
+	/* the timing summary line carries these instead */
+	if (!cl.timing_mode) {
+		fprintf(stderr, "distribution = %s, seed = %d\n",
+			client_distribution(&cl, summary, sizeof(summary)), cl.seed);
+	}
 
-	init_random();
+	if (cl.replay) {
+		client_replay(&cl);
+		cl.next = 0;
+		cl.nr_late = 0;
+	} else if (cl.rate > 0) {
+		/* the schedule, in ms from the start */
+		unsigned short xsubi[3] = { cl.seed, cl.seed >> 16, 0 };
+
+		cl.due = Malloc(sizeof(double) * cl.nr_requests);
+		cl.files = Malloc(sizeof(int) * cl.nr_requests);
+		cl.due[0] = 0;
+		for (i = 0; i < cl.nr_requests; i++) {
+			if (i > 0) {
+				cl.due[i] = cl.due[i - 1] + (cl.poisson ?
+					rand_exponential(1000 / cl.rate) :
+					1000 / cl.rate);
+			}
+			cl.files[i] = client_pick(&cl, xsubi);
+		}
+		cl.next = 0;
+		cl.nr_late = 0;
+	}
+
+	if (cl.timing_mode) {
+		cl.latencies = Malloc(sizeof(double) * cl.nr_requests);
+		cl.nr_latencies = 0;
+		gettimeofday(&start, NULL);
+	}
 
 	threads = Malloc(sizeof(pthread_t) * cl.nr_threads);
+	cl.start = now_ms();
 	for (i = 0; i < cl.nr_threads; i++) {
-		SYS(pthread_create(&threads[i], NULL, client_request,
+		SYS(pthread_create(&threads[i], NULL, cl.open_loop ?
+				   client_open_loop : client_request,
 				   (void *)&cl));
 	}
 	for (i = 0; i < cl.nr_threads; i++) {
@@ -213,10 +838,38 @@ main(int argc, char *argv[])
 	}
 
 	if (cl.timing_mode) {
+		double sum = 0;
+
 		gettimeofday(&end, NULL);
 		timersub(&end, &start, &diff);
-		printf("client runtime = %.6f seconds\n",
-			(float)diff.tv_sec + (float)diff.tv_usec / 1000000);
+		/* on one line, so that run-one-experiment still finds the
+		 * runtime in the fourth field */
+		if (cl.open_loop) {
+			print_open_loop(&cl);
+			/* for the summary line below */
+			for (i = 0; i < cl.nr_requests; i++) {
+				if (cl.latencies[i] >= 0)
+					cl.latencies[cl.nr_latencies++] =
+						cl.latencies[i];
+			}
+			free(cl.due);
+			free(cl.files);
+		}
+		qsort(cl.latencies, cl.nr_latencies, sizeof(double),
+		      cmp_double);
+		for (i = 0; i < cl.nr_latencies; i++) {
+			sum += cl.latencies[i];
+		}
+		printf("client runtime = %.6f seconds, "
+		       "mean latency = %.3f ms, p99 latency = %.3f ms, "
+		       "rejected = %d, distribution = %s, seed = %d\n",
+			(float)diff.tv_sec + (float)diff.tv_usec / 1000000,
+			cl.nr_latencies ? sum / cl.nr_latencies : 0,
+			percentile(cl.latencies, cl.nr_latencies, 0.99),
+			cl.nr_rejected,
+			client_distribution(&cl, summary, sizeof(summary)), cl.seed);
+		free(cl.latencies);
 	}
+	popularity_destroy(&cl.pop);
 	exit(0);
 }
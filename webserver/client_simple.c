@@ -16,10 +16,11 @@ static void
 client_send(int fd, char *host, char *filename)
 {
 	char buf[MAXLINE];
+	int n;
 
 	/* form and send the HTTP request */
-	sprintf(buf, "GET %s HTTP/1.0\r\n", filename);
-	sprintf(buf, "%shost: %s\r\n\r\n", buf, host);
+	n = sprintf(buf, "GET %s HTTP/1.0\r\n", filename);
+	sprintf(buf + n, "host: %s\r\n\r\n", host);
 	Rio_write(fd, buf, strlen(buf));
 }
 
@@ -103,6 +103,57 @@ rio_write(int fd, void *usrbuf, size_t n)
 	return n;
 }
 
+/* rio_writev - robustly write all the iovecs (unbuffered). iov is modified
+ * to track partial writes. */
+ssize_t
+rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t nwritten, total = 0;
+
+	while (iovcnt > 0) {
+		if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+			if (errno == EINTR)	/* interrupted by sig handler return */
+				nwritten = 0;	/* and call writev() again */
+			else
+				return -1;	/* errorno set by writev() */
+		}
+		total += nwritten;
+		while (iovcnt > 0 && nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return total;
+}
+
+/* rio_sendfile - robustly copy n bytes from the start of in_fd to out_fd,
+ * without copying them through user space. returns fewer than n bytes if
+ * in_fd shrank. */
+ssize_t
+rio_sendfile(int out_fd, int in_fd, size_t n)
+{
+	off_t offset = 0;
+	size_t nleft = n;
+	ssize_t nsent;
+
+	while (nleft > 0) {
+		if ((nsent = sendfile(out_fd, in_fd, &offset, nleft)) < 0) {
+			if (errno == EINTR)	/* interrupted by sig handler return */
+				nsent = 0;	/* and call sendfile() again */
+			else
+				return -1;	/* errno set by sendfile() */
+		} else if (nsent == 0)
+			break;	/* EOF, the file shrank */
+		nleft -= nsent;
+	}
+	return (n - nleft);
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -145,7 +196,8 @@ rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 	int n, rc;
 	char c, *bufp = usrbuf;
 
-	for (n = 0; n < maxlen; n++) {
+	/* leave room for the terminating null byte */
+	for (n = 0; n < maxlen - 1; n++) {
 		if ((rc = rio_readb(rp, &c, 1)) == 1) {
 			*bufp++ = c;
 			if (c == '\n') {
@@ -164,6 +216,47 @@ rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 	return n;
 }
 
+/* rio_readnb - robustly read n bytes (buffered) */
+static ssize_t
+rio_readnb(struct rio *rp, void *usrbuf, size_t n)
+{
+	size_t nleft = n;
+	ssize_t nread;
+	char *bufp = usrbuf;
+
+	while (nleft > 0) {
+		if ((nread = rio_readb(rp, bufp, nleft)) < 0)
+			return -1;	/* errno set by read() */
+		else if (nread == 0)
+			break;	/* EOF */
+		nleft -= nread;
+		bufp += nread;
+	}
+	return (n - nleft);	/* return >= 0 */
+}
+
+/* rio_wait - wait up to timeout ms for buffered or readable data. returns
+ * 1 if there is data, 0 on timeout and -1 if the descriptor failed */
+static int
+rio_wait(struct rio *rp, int timeout)
+{
+	struct pollfd pfd = {rp->rio_fd, POLLIN};
+	int n;
+
+	if (rp->rio_cnt > 0)
+		return 1;
+	do {
+		n = poll(&pfd, 1, timeout);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+	if (n == 0)
+		return 0;
+	if (pfd.revents & (POLLERR | POLLNVAL))
+		return -1;
+	return 1;	/* data, or EOF after a hang up */
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -209,6 +302,22 @@ Rio_readlineb(struct rio * rp, void *usrbuf, size_t maxlen)
 	return rc;
 }
 
+ssize_t
+Rio_readnb(struct rio *rp, void *usrbuf, size_t n)
+{
+	ssize_t rc;
+
+	if ((rc = rio_readnb(rp, usrbuf, n)) < 0)
+		unix_error("Rio_readnb error");
+	return rc;
+}
+
+int
+Rio_wait(struct rio *rp, int timeout)
+{
+	return rio_wait(rp, timeout);
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -267,9 +376,8 @@ open_clientfd(char *hostname, int port)
 	return clientfd;
 }
 
-/* open and return a listening socket on port */
-int
-open_listenfd(int port)
+static int
+listenfd_init(int port, int reuseport)
 {
 	int listenfd, optval = 1;
 	struct sockaddr_in serveraddr;
@@ -281,6 +389,13 @@ open_listenfd(int port)
 	SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
 		       (const void *)&optval, sizeof(int)));
 
+	/* Lets several sockets bind to the same port. The kernel spreads
+	   incoming connections over them. */
+	if (reuseport) {
+		SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+			       (const void *)&optval, sizeof(int)));
+	}
+
 	/* Listenfd will be an endpoint for all requests to port
 	   on any IP address for this host */
 	bzero((char *)&serveraddr, sizeof(serveraddr));
@@ -295,13 +410,29 @@ open_listenfd(int port)
 	return listenfd;
 }
 
+/* open and return a listening socket on port */
+int
+open_listenfd(int port)
+{
+	return listenfd_init(port, 0);
+}
+
+/* open and return a listening socket on port that shares the port with
+ * other sockets opened by this function */
+int
+open_listenfd_reuseport(int port)
+{
+	return listenfd_init(port, 1);
+}
+
 /*********************************************************
  * Functions for generating long-tail random distributions
  *********************************************************/
 
 #define RAND ((double)random())/RAND_MAX
 
-void
+/* seeds random() from /dev/urandom, and returns the seed */
+int
 init_random()
 {
 	int fd = open("/dev/urandom", O_RDONLY);
@@ -316,6 +447,7 @@ init_random()
 		exit(1);
 	}
 	srandom(seed);
+	return seed;
 }
 
 /* return value: >= 1 and <= high */
@@ -346,6 +478,18 @@ rand_pareto_int(double m, double a)
 	return round(rand_pareto(m, a));
 }
 
+/* exponentially distributed, such as the gaps between Poisson arrivals */
+double
+rand_exponential(double mean)
+{
+	double r = RAND;
+
+	while (r <= 0 || r >= 1)
+		r = RAND;
+
+	return -mean * log(r);
+}
+
 /*
  * Input: 0 < a < 1 
  * Return value: > 0 and <= 1
@@ -380,3 +524,33 @@ rand_self_similar_int(double a, int high)
 	assert(ret >= 1 && ret <= high);
 	return ret;
 }
+
+/*
+ * Returns the number of files in a fileset of about nr_files files with a
+ * mean size of mean_sz 4K blocks, and sets *sizes to a malloc'd array of
+ * their sizes in bytes. The fileset program creates files of these sizes,
+ * and the benchmarks model them.
+ *
+ * random() is seeded with a fixed seed first, or else the file size
+ * distributions vary too much, leading to high variance in results.
+ */
+int
+fileset_sizes(int mean_sz, int nr_files, int **sizes)
+{
+	double ms = mean_sz;
+	long total = 0;
+	int n = 0, max = 0;
+
+	*sizes = NULL;
+	srandom(100);
+	while (total < (long)mean_sz * 4096 * nr_files) {
+		if (n == max) {
+			max = max ? max * 2 : 256;
+			*sizes = realloc(*sizes, max * sizeof(int));
+			assert(*sizes);
+		}
+		(*sizes)[n] = rand_pareto(4096, ms / (ms - 1));
+		total += (*sizes)[n++];
+	}
+	return n;
+}
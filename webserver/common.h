@@ -15,6 +15,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -73,17 +75,27 @@ void Rio_destroy(struct rio *rp);
 ssize_t Rio_read(int fd, void *usrbuf, size_t n);
 void Rio_write(int fd, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readnb(struct rio *rp, void *usrbuf, size_t n);
+int Rio_wait(struct rio *rp, int timeout);
+
+/* Robust I/O routines that return errors instead of exiting, for writes
+ * that fail when a client goes away */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
+ssize_t rio_sendfile(int out_fd, int in_fd, size_t n);
 
 /* Wrappers for client/server helper functions */
 int open_clientfd(char *hostname, int port);
 int open_listenfd(int port);
+int open_listenfd_reuseport(int port);
 
 /* Random functions */
-void init_random();
+int init_random();
 int rand_int(int high);
 double rand_pareto(double m, double a);
 int rand_pareto_int(double m, double a);
+double rand_exponential(double mean);
 double rand_self_similar(double a);
 int rand_self_similar_int(double a, int high);
+int fileset_sizes(int mean_sz, int nr_files, int **sizes);
 
 #endif /* __CSAPP_H__ */
@@ -0,0 +1,187 @@
+/*
+ * epoch.c: Epoch-based reclamation, so that readers can walk a shared
+ * structure without a lock while writers unlink parts of it.
+ *
+ * A reader brackets its walk with epoch_enter and epoch_exit, which only
+ * write to the calling thread's own record. A writer that unlinks an object
+ * hands it to epoch_retire instead of freeing it. Objects are kept on one
+ * of three lists, by the global epoch in which they were retired, and the
+ * global epoch only advances once every thread inside an epoch has entered
+ * the current one. An object retired in epoch e is freed once the global
+ * epoch reaches e + 2, when no reader that could have seen it is left.
+ *
+ * Retiring takes a lock, and tries to advance the epoch on every call, so
+ * reclamation costs the writers and never the readers. Objects retired while
+ * a reader stays inside an epoch are kept until it leaves.
+ *
+ * Thread records are found and reused the same way as in stats.c.
+ */
+
+#include "common.h"
+#include "epoch.h"
+
+#define EPOCH_NR_LISTS 3
+#define EPOCH_CACHE_LINE 64
+
+struct epoch_retired {
+	void *p;
+	void (*free_fn)(void *);
+	struct epoch_retired *next;
+};
+
+struct epoch_thread {
+	/* the epoch the thread entered, or 0 outside of one */
+	unsigned long epoch;
+	int owned;		/* by a running thread */
+	struct epoch_thread *next;
+} __attribute__((aligned(EPOCH_CACHE_LINE)));
+
+struct epoch {
+	unsigned long global;	/* starts at 1, so that 0 means outside */
+	pthread_key_t key;
+	pthread_mutex_t lock;	/* protects the threads and the lists */
+	struct epoch_thread *threads;
+	struct epoch_retired *retired[EPOCH_NR_LISTS];
+};
+
+static void
+epoch_thread_exit(void *arg)
+{
+	struct epoch_thread *t = arg;
+
+	__atomic_store_n(&t->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* returns the calling thread's record */
+static struct epoch_thread *
+epoch_self(struct epoch *ep)
+{
+	struct epoch_thread *t = pthread_getspecific(ep->key);
+	void *p;
+	int err;
+
+	if (t)
+		return t;
+	pthread_mutex_lock(&ep->lock);
+	for (t = ep->threads; t; t = t->next) {
+		if (!__atomic_load_n(&t->owned, __ATOMIC_ACQUIRE))
+			break;
+	}
+	if (t == NULL) {
+		err = posix_memalign(&p, EPOCH_CACHE_LINE,
+				     sizeof(struct epoch_thread));
+		assert(err == 0);
+		t = p;
+		t->epoch = 0;
+		t->next = ep->threads;
+		ep->threads = t;
+	}
+	t->owned = 1;
+	pthread_mutex_unlock(&ep->lock);
+	SYS(pthread_setspecific(ep->key, t));
+	return t;
+}
+
+struct epoch *
+epoch_init(void)
+{
+	struct epoch *ep = Malloc(sizeof(struct epoch));
+	int i;
+
+	ep->global = 1;
+	SYS(pthread_key_create(&ep->key, epoch_thread_exit));
+	pthread_mutex_init(&ep->lock, NULL);
+	ep->threads = NULL;
+	for (i = 0; i < EPOCH_NR_LISTS; i++) {
+		ep->retired[i] = NULL;
+	}
+	return ep;
+}
+
+/* objects retired after this call are not freed until epoch_exit */
+void
+epoch_enter(struct epoch *ep)
+{
+	struct epoch_thread *t = epoch_self(ep);
+
+	__atomic_store_n(&t->epoch,
+			 __atomic_load_n(&ep->global, __ATOMIC_ACQUIRE),
+			 __ATOMIC_SEQ_CST);
+	/* the walk must not read anything before the epoch is visible */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+epoch_exit(struct epoch *ep)
+{
+	struct epoch_thread *t = epoch_self(ep);
+
+	__atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static void
+epoch_free_list(struct epoch_retired *r)
+{
+	struct epoch_retired *next;
+
+	for (; r; r = next) {
+		next = r->next;
+		r->free_fn(r->p);
+		free(r);
+	}
+}
+
+/* frees p with free_fn once no reader can still be using it. p must no
+ * longer be reachable by readers that enter an epoch after this call. */
+void
+epoch_retire(struct epoch *ep, void *p, void (*free_fn)(void *))
+{
+	struct epoch_retired *r = Malloc(sizeof(struct epoch_retired));
+	struct epoch_retired *done;
+	struct epoch_thread *t;
+	unsigned long global, e;
+
+	r->p = p;
+	r->free_fn = free_fn;
+	pthread_mutex_lock(&ep->lock);
+	global = ep->global;
+	r->next = ep->retired[global % EPOCH_NR_LISTS];
+	ep->retired[global % EPOCH_NR_LISTS] = r;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (t = ep->threads; t; t = t->next) {
+		e = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+		if (e != 0 && e != global)
+			break;
+	}
+	if (t) {
+		/* a reader is still in an older epoch */
+		pthread_mutex_unlock(&ep->lock);
+		return;
+	}
+	__atomic_store_n(&ep->global, global + 1, __ATOMIC_RELEASE);
+	/* retired in epoch global - 1, before any reader now inside entered */
+	done = ep->retired[(global + 2) % EPOCH_NR_LISTS];
+	ep->retired[(global + 2) % EPOCH_NR_LISTS] = NULL;
+	pthread_mutex_unlock(&ep->lock);
+	epoch_free_list(done);
+}
+
+/* frees everything retired. no thread may be inside an epoch. */
+void
+epoch_destroy(struct epoch *ep)
+{
+	struct epoch_thread *t, *next;
+	int i;
+
+	for (i = 0; i < EPOCH_NR_LISTS; i++) {
+		epoch_free_list(ep->retired[i]);
+	}
+	for (t = ep->threads; t; t = next) {
+		next = t->next;
+		free(t);
+	}
+	pthread_key_delete(ep->key);
+	pthread_mutex_destroy(&ep->lock);
+	free(ep);
+}
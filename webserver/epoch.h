@@ -0,0 +1,12 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+struct epoch;
+
+struct epoch *epoch_init(void);
+void epoch_enter(struct epoch *ep);
+void epoch_exit(struct epoch *ep);
+void epoch_retire(struct epoch *ep, void *p, void (*free_fn)(void *));
+void epoch_destroy(struct epoch *ep);
+
+#endif /* __EPOCH_H__ */
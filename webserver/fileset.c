@@ -39,7 +39,7 @@ main(int argc, const char *argv[])
 	DIR *d;
 	char filename[1024];
 	int current_fileset_sz = 0;
-	int total_fileset_sz;
+	int *sizes, nr_sizes;
 	int fd_idx;
 	char idx_buf[4096];
 	char idx_buffer[4096 * 256]; // a large buffer
@@ -99,26 +99,22 @@ main(int argc, const char *argv[])
 			exit(1);
 		}
 	}
-	// fix the seed of the random number generator, or else the file size
-	// distributions vary too much, leading to high variance in results.
+	// the file sizes come from a fixed seed, see fileset_sizes.
 	// note that the client still uses a random seed to request files.
-	// init_random();
-	srandom(100);
-	total_fileset_sz = default_file_sz * 4096 * default_nr_files;
+	nr_sizes = fileset_sizes(default_file_sz, default_nr_files, &sizes);
 	/* null terminate the buffer */
 	idx_buffer[0] = 0;
-	while (current_fileset_sz < total_fileset_sz) {
-		char name[10];
+	while (nr_files < nr_sizes) {
+		char name[16];
 		int fd, file_sz, remaining;
 		char buf[4096];
-		double ms = default_file_sz;
 		unsigned int csum = 0;
 		int j;
 
+		file_sz = sizes[nr_files];
 		strcpy(filename, dir);
 		sprintf(name, "/%05d", nr_files++);
 		strcat(filename, name);
-		file_sz = rand_pareto(4096, ms/(ms - 1));
 		current_fileset_sz += file_sz;
 		SYS(fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644));
 		remaining = file_sz;
@@ -153,6 +149,7 @@ main(int argc, const char *argv[])
 	/* write the rest of the buffer */
 	Rio_write(fd_idx, idx_buffer, strlen(idx_buffer));
 	SYS(close(fd_idx));
+	free(sizes);
 	
 	printf("file set size = %d, nr files = %d\n"
 	       "mean file size = %d, expected mean file size = %d\n",
@@ -0,0 +1,616 @@
+/*
+ * policy.c: Eviction policies for the file cache.
+ *
+ *  lru     evicts the least recently used file
+ *  clock   second chance approximation of LRU, hits only set a bit
+ *  arc     adaptive replacement cache, balancing recency and frequency
+ *  s3fifo  small and main FIFO queues, with a ghost queue of evicted files
+ *  gds     GreedyDual-Size, which weighs the cost of a miss against the
+ *          space a file takes up
+ *
+ * All sizes are in bytes, since the cache budget is in bytes and file sizes
+ * vary by orders of magnitude.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "policy.h"
+
+static long
+entry_size(CacheEntry *entry)
+{
+	return entry->data->file_size;
+}
+
+//	=================	LRU Functions	=================	//
+
+// Appends given entry to the end (most recently used) of the queue
+static void add_to_LRU(LRUList *LRU, CacheEntry *entry) {
+	entry->lru_prev = LRU->tail;
+	entry->lru_next = NULL;
+	if (LRU->tail == NULL) {
+		// LRU is currently empty
+		LRU->head = entry;
+	} else {
+		LRU->tail->lru_next = entry;	// Append to end of queue
+	}
+	LRU->tail = entry;	// Move tail to new end of queue
+	LRU->size++;	// Update queue size
+	LRU->bytes += entry_size(entry);
+}
+
+// Inserts given entry just before pos, or at the end if pos is NULL
+static void insert_before_LRU(LRUList *LRU, CacheEntry *pos, CacheEntry *entry) {
+	if (pos == NULL) {
+		add_to_LRU(LRU, entry);
+		return;
+	}
+	entry->lru_next = pos;
+	entry->lru_prev = pos->lru_prev;
+	if (pos->lru_prev)
+		pos->lru_prev->lru_next = entry;
+	else
+		LRU->head = entry;
+	pos->lru_prev = entry;
+	LRU->size++;
+	LRU->bytes += entry_size(entry);
+}
+
+// Unlinks given entry from the queue
+static void remove_from_LRU(LRUList *LRU, CacheEntry *entry) {
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		LRU->head = entry->lru_next;	// Removing head
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		LRU->tail = entry->lru_prev;	// Removing tail
+
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+	LRU->size--;	// Update queue size
+	LRU->bytes -= entry_size(entry);
+}
+
+// Marks given entry as most recently used
+static void move_node_to_end(LRUList *LRU, CacheEntry *entry) {
+	if (LRU->tail == entry)
+		return;
+	remove_from_LRU(LRU, entry);
+	add_to_LRU(LRU, entry);
+}
+
+// Removes and returns the head of the queue
+static CacheEntry* pop_LRU(LRUList *LRU) {
+	CacheEntry *head = LRU->head;
+	if (head)
+		remove_from_LRU(LRU, head);
+	return head;
+}
+
+//	=================	End of LRU Functions		=================	//
+
+
+//	=================	Ghost Lists	=================	//
+
+// A ghost list remembers the hashes of recently evicted files, without their
+// data, up to max_bytes worth of files. Oldest ghosts are dropped first.
+
+struct ghost_node {
+	unsigned long hash;
+	long size;
+	struct ghost_node *chain;	// Next node in hash bucket
+	struct ghost_node *prev;	// Age order, oldest at head
+	struct ghost_node *next;
+};
+
+struct ghost {
+	struct ghost_node **buckets;
+	unsigned long capacity;	// Always a power of two
+	struct ghost_node *head;
+	struct ghost_node *tail;
+	long bytes;
+	long max_bytes;
+};
+
+static void ghost_init(struct ghost *g, long max_bytes) {
+	g->capacity = 64;
+	while (g->capacity < max_bytes / 4096)
+		g->capacity *= 2;
+	g->buckets = (struct ghost_node **) calloc(g->capacity, sizeof(struct ghost_node *));
+	assert(g->buckets);
+	g->head = NULL;
+	g->tail = NULL;
+	g->bytes = 0;
+	g->max_bytes = max_bytes;
+}
+
+static struct ghost_node **ghost_bucket(struct ghost *g, unsigned long hash) {
+	return &g->buckets[(hash ^ (hash >> 17)) & (g->capacity - 1)];
+}
+
+static void ghost_unlink(struct ghost *g, struct ghost_node **link) {
+	struct ghost_node *node = *link;
+
+	*link = node->chain;
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		g->head = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		g->tail = node->prev;
+	g->bytes -= node->size;
+	free(node);
+}
+
+// Forgets the ghost for hash. Returns 1 if there was one.
+static int ghost_remove(struct ghost *g, unsigned long hash) {
+	struct ghost_node **link;
+
+	for (link = ghost_bucket(g, hash); *link != NULL; link = &(*link)->chain) {
+		if ((*link)->hash == hash) {
+			ghost_unlink(g, link);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void ghost_add(struct ghost *g, unsigned long hash, long size) {
+	struct ghost_node *node = (struct ghost_node *) malloc(sizeof(struct ghost_node));
+	struct ghost_node **bucket = ghost_bucket(g, hash);
+
+	assert(node);
+	node->hash = hash;
+	node->size = size;
+	node->chain = *bucket;
+	*bucket = node;
+	node->prev = g->tail;
+	node->next = NULL;
+	if (g->tail)
+		g->tail->next = node;
+	else
+		g->head = node;
+	g->tail = node;
+	g->bytes += size;
+
+	while (g->bytes > g->max_bytes) {
+		struct ghost_node **link = ghost_bucket(g, g->head->hash);
+		while (*link != g->head)
+			link = &(*link)->chain;
+		ghost_unlink(g, link);
+	}
+}
+
+static void ghost_destroy(struct ghost *g) {
+	while (g->head) {
+		struct ghost_node *next = g->head->next;
+		free(g->head);
+		g->head = next;
+	}
+	free(g->buckets);
+}
+
+//	=================	End of Ghost Lists	=================	//
+
+
+//	=================	LRU	=================	//
+
+static void *lru_init(long max_size) {
+	LRUList *LRU = (LRUList *) calloc(1, sizeof(LRUList));
+	assert(LRU);
+	return LRU;
+}
+
+static void lru_destroy(void *state) {
+	free(state);
+}
+
+static void lru_insert(void *state, CacheEntry *entry) {
+	add_to_LRU(state, entry);
+}
+
+static void lru_hit(void *state, CacheEntry *entry) {
+	move_node_to_end(state, entry);
+}
+
+static CacheEntry *lru_evict(void *state) {
+	return pop_LRU(state);
+}
+
+static CacheEntry *lru_victim(void *state, CacheEntry *prev) {
+	LRUList *LRU = state;
+	return prev ? prev->lru_next : LRU->head;
+}
+
+//	=================	CLOCK	=================	//
+
+// Entries sit on a ring, and a hit only sets the entry's reference bit. The
+// hand sweeps the ring clearing reference bits, and evicts the first entry
+// whose bit is already clear.
+
+struct clock {
+	LRUList ring;	// The tail wraps around to the head
+	CacheEntry *hand;
+};
+
+static void *clock_init(long max_size) {
+	struct clock *clock = (struct clock *) calloc(1, sizeof(struct clock));
+	assert(clock);
+	return clock;
+}
+
+static void clock_destroy(void *state) {
+	free(state);
+}
+
+static CacheEntry *clock_next(struct clock *clock, CacheEntry *entry) {
+	return entry->lru_next ? entry->lru_next : clock->ring.head;
+}
+
+static void clock_insert(void *state, CacheEntry *entry) {
+	struct clock *clock = state;
+
+	// New entries go just behind the hand, so they get a full sweep
+	entry->ref = 0;
+	insert_before_LRU(&clock->ring, clock->hand, entry);
+}
+
+static void clock_hit(void *state, CacheEntry *entry) {
+	__atomic_store_n(&entry->ref, 1, __ATOMIC_RELAXED);
+}
+
+static CacheEntry *clock_evict(void *state) {
+	struct clock *clock = state;
+	CacheEntry *entry;
+
+	if (clock->ring.head == NULL)
+		return NULL;
+	entry = clock->hand ? clock->hand : clock->ring.head;
+	while (__atomic_load_n(&entry->ref, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&entry->ref, 0, __ATOMIC_RELAXED);
+		entry = clock_next(clock, entry);
+	}
+	clock->hand = clock_next(clock, entry);
+	if (clock->hand == entry)
+		clock->hand = NULL;
+	remove_from_LRU(&clock->ring, entry);
+	return entry;
+}
+
+static CacheEntry *clock_victim(void *state, CacheEntry *prev) {
+	struct clock *clock = state;
+	CacheEntry *entry;
+	int i;
+
+	// Evicting clears reference bits, so only the first victim is known
+	if (prev || clock->ring.head == NULL)
+		return NULL;
+	entry = clock->hand ? clock->hand : clock->ring.head;
+	for (i = 0; i < clock->ring.size; i++) {
+		if (!__atomic_load_n(&entry->ref, __ATOMIC_RELAXED))
+			return entry;
+		entry = clock_next(clock, entry);
+	}
+	return entry;
+}
+
+//	=================	ARC	=================	//
+
+// T1 holds files requested once recently, T2 files requested at least twice.
+// B1 and B2 remember files recently evicted from T1 and T2. A miss on a B1
+// ghost means T1 was too small, so its target size p grows; a miss on a B2
+// ghost shrinks it.
+
+#define ARC_T1 0
+#define ARC_T2 1
+
+struct arc {
+	LRUList t[2];
+	struct ghost b[2];
+	long p;	// Target size of T1
+	long c;	// Budget
+};
+
+static void *arc_init(long max_size) {
+	struct arc *arc = (struct arc *) calloc(1, sizeof(struct arc));
+	assert(arc);
+	ghost_init(&arc->b[ARC_T1], max_size);
+	ghost_init(&arc->b[ARC_T2], max_size);
+	arc->p = 0;
+	arc->c = max_size;
+	return arc;
+}
+
+static void arc_destroy(void *state) {
+	struct arc *arc = state;
+	ghost_destroy(&arc->b[ARC_T1]);
+	ghost_destroy(&arc->b[ARC_T2]);
+	free(arc);
+}
+
+static void arc_insert(void *state, CacheEntry *entry) {
+	struct arc *arc = state;
+	long size = entry_size(entry);
+	long b1 = arc->b[ARC_T1].bytes, b2 = arc->b[ARC_T2].bytes;
+
+	if (ghost_remove(&arc->b[ARC_T1], entry->hash)) {
+		arc->p += (b2 > b1 && b1 > 0) ? size * (b2 / b1) : size;
+		if (arc->p > arc->c)
+			arc->p = arc->c;
+		entry->list = ARC_T2;
+	} else if (ghost_remove(&arc->b[ARC_T2], entry->hash)) {
+		arc->p -= (b1 > b2 && b2 > 0) ? size * (b1 / b2) : size;
+		if (arc->p < 0)
+			arc->p = 0;
+		entry->list = ARC_T2;
+	} else {
+		entry->list = ARC_T1;
+	}
+	add_to_LRU(&arc->t[entry->list], entry);
+}
+
+static void arc_hit(void *state, CacheEntry *entry) {
+	struct arc *arc = state;
+
+	remove_from_LRU(&arc->t[entry->list], entry);
+	entry->list = ARC_T2;
+	add_to_LRU(&arc->t[ARC_T2], entry);
+}
+
+// The list to evict from next
+static int arc_replace(struct arc *arc) {
+	if (arc->t[ARC_T1].size > 0 &&
+	    (arc->t[ARC_T1].bytes > arc->p || arc->t[ARC_T2].size == 0))
+		return ARC_T1;
+	return ARC_T2;
+}
+
+static CacheEntry *arc_evict(void *state) {
+	struct arc *arc = state;
+	int list = arc_replace(arc);
+	CacheEntry *entry = pop_LRU(&arc->t[list]);
+
+	if (entry)
+		ghost_add(&arc->b[list], entry->hash, entry_size(entry));
+	return entry;
+}
+
+static CacheEntry *arc_victim(void *state, CacheEntry *prev) {
+	struct arc *arc = state;
+	return prev ? prev->lru_next : arc->t[arc_replace(arc)].head;
+}
+
+//	=================	S3-FIFO	=================	//
+
+// New files go into a small FIFO queue S that gets a tenth of the budget.
+// Files that are hit while in S move to the main FIFO queue M when they
+// reach the head, the rest are evicted and remembered in the ghost queue G.
+// Files that miss while in G go straight into M. Files at the head of M that
+// were hit get reinserted instead of evicted.
+
+#define S3FIFO_SMALL 0
+#define S3FIFO_MAIN 1
+#define S3FIFO_MAX_FREQ 3
+
+struct s3fifo {
+	LRUList q[2];
+	struct ghost g;
+	long small_max;
+};
+
+static void *s3fifo_init(long max_size) {
+	struct s3fifo *s3 = (struct s3fifo *) calloc(1, sizeof(struct s3fifo));
+	assert(s3);
+	ghost_init(&s3->g, max_size);
+	s3->small_max = max_size / 10;
+	return s3;
+}
+
+static void s3fifo_destroy(void *state) {
+	struct s3fifo *s3 = state;
+	ghost_destroy(&s3->g);
+	free(s3);
+}
+
+static void s3fifo_insert(void *state, CacheEntry *entry) {
+	struct s3fifo *s3 = state;
+
+	entry->ref = 0;
+	entry->list = ghost_remove(&s3->g, entry->hash) ? S3FIFO_MAIN : S3FIFO_SMALL;
+	add_to_LRU(&s3->q[entry->list], entry);
+}
+
+static void s3fifo_hit(void *state, CacheEntry *entry) {
+	int freq = __atomic_load_n(&entry->ref, __ATOMIC_RELAXED);
+
+	while (freq < S3FIFO_MAX_FREQ &&
+	       !__atomic_compare_exchange_n(&entry->ref, &freq, freq + 1, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// Evict from S while it is over its share, or when M is empty
+static int s3fifo_small_turn(struct s3fifo *s3) {
+	return s3->q[S3FIFO_SMALL].size > 0 &&
+		(s3->q[S3FIFO_SMALL].bytes > s3->small_max || s3->q[S3FIFO_MAIN].size == 0);
+}
+
+static CacheEntry *s3fifo_evict(void *state) {
+	struct s3fifo *s3 = state;
+	CacheEntry *entry;
+
+	while (1) {
+		if (s3fifo_small_turn(s3)) {
+			entry = pop_LRU(&s3->q[S3FIFO_SMALL]);
+			// Hits may still be counting, without the shard lock
+			if (__atomic_load_n(&entry->ref, __ATOMIC_RELAXED) > 0) {
+				__atomic_store_n(&entry->ref, 0, __ATOMIC_RELAXED);
+				entry->list = S3FIFO_MAIN;
+				add_to_LRU(&s3->q[S3FIFO_MAIN], entry);
+				continue;
+			}
+			ghost_add(&s3->g, entry->hash, entry_size(entry));
+			return entry;
+		}
+		entry = pop_LRU(&s3->q[S3FIFO_MAIN]);
+		if (entry == NULL)
+			return NULL;
+		if (__atomic_load_n(&entry->ref, __ATOMIC_RELAXED) > 0) {
+			__atomic_sub_fetch(&entry->ref, 1, __ATOMIC_RELAXED);
+			add_to_LRU(&s3->q[S3FIFO_MAIN], entry);
+			continue;
+		}
+		return entry;
+	}
+}
+
+static CacheEntry *s3fifo_victim(void *state, CacheEntry *prev) {
+	struct s3fifo *s3 = state;
+	CacheEntry *entry;
+
+	// Evicting moves entries around, so only the first victim is known
+	if (prev)
+		return NULL;
+	entry = s3->q[s3fifo_small_turn(s3) ? S3FIFO_SMALL : S3FIFO_MAIN].head;
+	while (entry && __atomic_load_n(&entry->ref, __ATOMIC_RELAXED) > 0)
+		entry = entry->lru_next;
+	return entry;
+}
+
+//	=================	GreedyDual-Size	=================	//
+
+// Each file has a value H = L + cost / size, where cost is what a miss on
+// the file costs and L is the H of the last evicted file. A hit restores H,
+// and the file with the smallest H is evicted. Small files that are
+// expensive to read stay cached, large files that are cheap per byte go.
+
+// A miss in request_readfile pays the simulated slow disk delay, in
+// microseconds, plus the time to read the file at roughly 100 MB/s
+#define GDS_MISS_DELAY 10000.0
+#define GDS_BYTES_PER_USEC 100.0
+
+struct gds {
+	CacheEntry **heap;	// Min-heap on priority
+	long size;
+	long capacity;
+	double L;
+};
+
+static void *gds_init(long max_size) {
+	struct gds *gds = (struct gds *) calloc(1, sizeof(struct gds));
+	assert(gds);
+	gds->capacity = 64;
+	gds->heap = (CacheEntry **) malloc(gds->capacity * sizeof(CacheEntry *));
+	assert(gds->heap);
+	return gds;
+}
+
+static void gds_destroy(void *state) {
+	struct gds *gds = state;
+	free(gds->heap);
+	free(gds);
+}
+
+static double gds_priority(struct gds *gds, CacheEntry *entry) {
+	long size = entry_size(entry) > 0 ? entry_size(entry) : 1;
+	double cost = GDS_MISS_DELAY + size / GDS_BYTES_PER_USEC;
+	return gds->L + cost / size;
+}
+
+static void gds_swap(struct gds *gds, long i, long j) {
+	CacheEntry *tmp = gds->heap[i];
+	gds->heap[i] = gds->heap[j];
+	gds->heap[j] = tmp;
+	gds->heap[i]->heap_idx = i;
+	gds->heap[j]->heap_idx = j;
+}
+
+static void gds_sift_up(struct gds *gds, long i) {
+	while (i > 0 && gds->heap[(i - 1) / 2]->priority > gds->heap[i]->priority) {
+		gds_swap(gds, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void gds_sift_down(struct gds *gds, long i) {
+	while (1) {
+		long min = i, l = 2 * i + 1, r = 2 * i + 2;
+		if (l < gds->size && gds->heap[l]->priority < gds->heap[min]->priority)
+			min = l;
+		if (r < gds->size && gds->heap[r]->priority < gds->heap[min]->priority)
+			min = r;
+		if (min == i)
+			return;
+		gds_swap(gds, i, min);
+		i = min;
+	}
+}
+
+static void gds_insert(void *state, CacheEntry *entry) {
+	struct gds *gds = state;
+
+	if (gds->size == gds->capacity) {
+		gds->capacity *= 2;
+		gds->heap = (CacheEntry **) realloc(gds->heap, gds->capacity * sizeof(CacheEntry *));
+		assert(gds->heap);
+	}
+	entry->priority = gds_priority(gds, entry);
+	entry->heap_idx = gds->size;
+	gds->heap[gds->size++] = entry;
+	gds_sift_up(gds, entry->heap_idx);
+}
+
+static void gds_hit(void *state, CacheEntry *entry) {
+	struct gds *gds = state;
+
+	// L never decreases, so the priority can only go up
+	entry->priority = gds_priority(gds, entry);
+	gds_sift_down(gds, entry->heap_idx);
+}
+
+static CacheEntry *gds_evict(void *state) {
+	struct gds *gds = state;
+	CacheEntry *entry;
+
+	if (gds->size == 0)
+		return NULL;
+	entry = gds->heap[0];
+	gds->L = entry->priority;
+	gds_swap(gds, 0, --gds->size);
+	gds_sift_down(gds, 0);
+	return entry;
+}
+
+static CacheEntry *gds_victim(void *state, CacheEntry *prev) {
+	struct gds *gds = state;
+	return (prev || gds->size == 0) ? NULL : gds->heap[0];
+}
+
+//	=================	Policy Table	=================	//
+
+static const struct cache_policy policies[] = {
+	{ "lru", 0, lru_init, lru_destroy, lru_insert, lru_hit,
+	  lru_evict, lru_victim },
+	{ "clock", 1, clock_init, clock_destroy, clock_insert, clock_hit,
+	  clock_evict, clock_victim },
+	{ "arc", 0, arc_init, arc_destroy, arc_insert, arc_hit,
+	  arc_evict, arc_victim },
+	{ "s3fifo", 1, s3fifo_init, s3fifo_destroy, s3fifo_insert, s3fifo_hit,
+	  s3fifo_evict, s3fifo_victim },
+	{ "gds", 0, gds_init, gds_destroy, gds_insert, gds_hit,
+	  gds_evict, gds_victim },
+};
+
+// Returns the policy called name, or NULL if there is none
+const struct cache_policy *cache_policy_find(const char *name) {
+	for (int i=0; i<sizeof(policies) / sizeof(policies[0]); ++i) {
+		if (!strcmp(policies[i].name, name))
+			return &policies[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+/* Eviction policies for the file cache. Only cache.c and policy.c use this
+ * header. */
+
+struct file_data;
+
+typedef struct cache_entry {
+	struct file_data *data;	// The cache holds one reference to data
+	unsigned long hash;	// Full hash of the file name
+	struct cache_entry *next;	// Next entry in hash chain
+
+	// Policy list links. The lists are intrusive so that an entry can be
+	// promoted or unlinked without searching for it.
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+
+	// Per-entry policy state
+	int ref;	// CLOCK reference bit, S3-FIFO access count
+	int list;	// Which of the policy's lists the entry is on
+	double priority;	// GreedyDual-Size H value
+	long heap_idx;	// GreedyDual-Size heap position
+
+	long hits;	// Requests served from the entry, to rank hot files
+	int evicted;	// Evicted, but lookups may still be using the entry
+} CacheEntry;
+
+typedef struct lru {
+	CacheEntry *head;	// Least recently used
+	CacheEntry *tail;	// Most recently used
+	int size;
+	long bytes;
+} LRUList;
+
+// An eviction policy keeps its own ordering of a shard's entries. All calls
+// except hit are made with the shard lock held exclusively and the shard's
+// lru_lock held. hit is made without the shard lock, so it may race with
+// them. Unless lockless_hit is set, it is made under lru_lock and only for
+// entries that have not been evicted.
+struct cache_policy {
+	const char *name;
+	int lockless_hit;
+
+	// Returns the policy state for a shard of max_size bytes
+	void *(*init)(long max_size);
+	void (*destroy)(void *state);
+
+	// A new entry was added to the shard
+	void (*insert)(void *state, CacheEntry *entry);
+	// An entry was requested
+	void (*hit)(void *state, CacheEntry *entry);
+	// Chooses an entry to evict and forgets it, or returns NULL if empty
+	CacheEntry *(*evict)(void *state);
+	// Returns the entry that would be evicted after prev, or the first one
+	// if prev is NULL, without changing any state. May return NULL early
+	// if the policy cannot tell.
+	CacheEntry *(*victim)(void *state, CacheEntry *prev);
+};
+
+const struct cache_policy *cache_policy_find(const char *name);
+
+#endif /* __POLICY_H__ */
@@ -0,0 +1,654 @@
+/*
+ * queue.c: Bounded lock-free multi-producer multi-consumer queue of
+ * non-negative ints, used to hand connections to the worker threads.
+ *
+ * The ring follows Dmitry Vyukov's bounded MPMC queue. Every cell has a
+ * sequence number that says whether the cell is free for the producer, or
+ * full for the consumer, at a given position. Producers and consumers claim
+ * positions with a compare-and-swap on the tail and head counters, so they
+ * never take a lock.
+ *
+ * Threads only sleep when the ring is empty (consumers) or full (producers).
+ * They sleep on an eventcount: a futex word that is bumped after every push
+ * or pop that someone is waiting for, together with a count of waiters so
+ * that nobody makes a system call while no one is asleep. Each push wakes at
+ * most one consumer, and each pop wakes at most one producer.
+ */
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "common.h"
+#include "queue.h"
+
+#define CACHE_LINE 64
+
+struct queue_cell {
+	unsigned long seq;
+	int value;
+};
+
+/* a futex word to sleep on, and the number of threads sleeping on it */
+struct eventcount {
+	int epoch;
+	int nr_waiters;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct queue {
+	struct queue_cell *cells;
+	unsigned long capacity;
+	int closed;
+	/* producers and consumers update these, so keep them on separate
+	 * cache lines */
+	unsigned long tail __attribute__((aligned(CACHE_LINE)));
+	unsigned long head __attribute__((aligned(CACHE_LINE)));
+	struct eventcount not_empty;	/* consumers wait here */
+	struct eventcount not_full;	/* producers wait here */
+};
+
+/* returns 0 if timeout, when not NULL, expired */
+static int
+futex_wait(int *addr, int val, const struct timespec *timeout)
+{
+	/* returns early if *addr != val, or on a signal. callers recheck */
+	return !(syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout,
+			 NULL, 0) < 0 && errno == ETIMEDOUT);
+}
+
+static void
+futex_wake(int *addr, int nr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+/* wakes up to nr threads waiting on ec, if there are any */
+static void
+eventcount_signal(struct eventcount *ec, int nr)
+{
+	/* pairs with the fence in eventcount_prepare: either the waiter
+	 * sees the change to the ring, or we see the waiter */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ec->nr_waiters, __ATOMIC_RELAXED) == 0)
+		return;
+	__atomic_add_fetch(&ec->epoch, 1, __ATOMIC_RELEASE);
+	futex_wake(&ec->epoch, nr);
+}
+
+/* registers as a waiter and returns the epoch to wait on. the caller must
+ * check its condition again before calling eventcount_wait */
+static int
+eventcount_prepare(struct eventcount *ec)
+{
+	int epoch = __atomic_load_n(&ec->epoch, __ATOMIC_ACQUIRE);
+
+	__atomic_add_fetch(&ec->nr_waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return epoch;
+}
+
+static void
+eventcount_cancel(struct eventcount *ec)
+{
+	__atomic_sub_fetch(&ec->nr_waiters, 1, __ATOMIC_RELAXED);
+}
+
+/* returns 0 if timeout, when not NULL, expired */
+static int
+eventcount_wait(struct eventcount *ec, int epoch,
+		const struct timespec *timeout)
+{
+	int ret = futex_wait(&ec->epoch, epoch, timeout);
+
+	eventcount_cancel(ec);
+	return ret;
+}
+
+/* the queue holds at least two values */
+struct queue *
+queue_init(int capacity)
+{
+	struct queue *q = NULL;
+	unsigned long i;
+	int ret;
+
+	assert(capacity > 0);
+	ret = posix_memalign((void **)&q, CACHE_LINE, sizeof(struct queue));
+	assert(ret == 0 && q);
+	/* with a single cell, a full cell and a freed cell would have the same
+	 * sequence number */
+	q->capacity = capacity < 2 ? 2 : capacity;
+	q->cells = Malloc(q->capacity * sizeof(struct queue_cell));
+	for (i = 0; i < q->capacity; i++) {
+		q->cells[i].seq = i;
+	}
+	q->closed = 0;
+	q->tail = 0;
+	q->head = 0;
+	q->not_empty.epoch = 0;
+	q->not_empty.nr_waiters = 0;
+	q->not_full.epoch = 0;
+	q->not_full.nr_waiters = 0;
+	return q;
+}
+
+/* returns 1 if value was added, 0 if the queue is full */
+static int
+queue_try_push(struct queue *q, int value)
+{
+	unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	struct queue_cell *cell;
+
+	while (1) {
+		long diff;
+
+		cell = &q->cells[pos % q->capacity];
+		diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			/* the cell is free for this position, claim it */
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* the consumer of the last lap has not freed it */
+			return 0;
+		} else {
+			/* another producer claimed it first */
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->value = value;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* returns a value, or -1 if the queue is empty */
+static int
+queue_try_pop(struct queue *q)
+{
+	unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	struct queue_cell *cell;
+	int value;
+
+	while (1) {
+		long diff;
+
+		cell = &q->cells[pos % q->capacity];
+		diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+			      (pos + 1));
+		if (diff == 0) {
+			/* the cell holds the value for this position */
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* the producer has not filled it yet */
+			return -1;
+		} else {
+			/* another consumer took it first */
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	value = cell->value;
+	/* free the cell for the producer of the next lap */
+	__atomic_store_n(&cell->seq, pos + q->capacity, __ATOMIC_RELEASE);
+	return value;
+}
+
+/* adds value to the queue, waiting while it is full. the caller wakes the
+ * consumers */
+static void
+queue_push_wait(struct queue *q, int value)
+{
+	assert(value >= 0);
+	while (!queue_try_push(q, value)) {
+		int epoch = eventcount_prepare(&q->not_full);
+		if (queue_try_push(q, value)) {
+			eventcount_cancel(&q->not_full);
+			break;
+		}
+		eventcount_wait(&q->not_full, epoch, NULL);
+	}
+}
+
+/* adds value to the queue, waiting while it is full */
+void
+queue_push(struct queue *q, int value)
+{
+	queue_push_wait(q, value);
+	eventcount_signal(&q->not_empty, 1);
+}
+
+/* adds value to the queue unless it is full. returns 1 if value was added */
+int
+queue_push_nowait(struct queue *q, int value)
+{
+	assert(value >= 0);
+	if (!queue_try_push(q, value))
+		return 0;
+	eventcount_signal(&q->not_empty, 1);
+	return 1;
+}
+
+/* takes the oldest value from the queue, or returns -1 if it is empty */
+int
+queue_pop_nowait(struct queue *q)
+{
+	int value = queue_try_pop(q);
+
+	if (value >= 0)
+		eventcount_signal(&q->not_full, 1);
+	return value;
+}
+
+/* takes the oldest value from the queue, waiting while it is empty, for up
+ * to timeout if it is not NULL. returns -1 once the queue is closed, even if
+ * values are left, and QUEUE_TIMEDOUT if the wait timed out */
+static int
+queue_pop_wait(struct queue *q, const struct timespec *timeout)
+{
+	int value;
+
+	while (1) {
+		int epoch;
+
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE))
+			return -1;
+		if ((value = queue_try_pop(q)) >= 0)
+			break;
+		epoch = eventcount_prepare(&q->not_empty);
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+			eventcount_cancel(&q->not_empty);
+			return -1;
+		}
+		if ((value = queue_try_pop(q)) >= 0) {
+			eventcount_cancel(&q->not_empty);
+			break;
+		}
+		if (!eventcount_wait(&q->not_empty, epoch, timeout))
+			return QUEUE_TIMEDOUT;
+	}
+	eventcount_signal(&q->not_full, 1);
+	return value;
+}
+
+/* takes the oldest value from the queue, waiting while it is empty. returns
+ * -1 once the queue is closed, even if values are left */
+int
+queue_pop(struct queue *q)
+{
+	return queue_pop_wait(q, NULL);
+}
+
+/* like queue_pop, but returns QUEUE_TIMEDOUT if no value arrives within
+ * about timeout ms */
+int
+queue_pop_timeout(struct queue *q, int timeout)
+{
+	struct timespec ts;
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+	return queue_pop_wait(q, &ts);
+}
+
+/* returns the number of values waiting to be taken. the count may be stale
+ * by the time the caller looks at it */
+long
+queue_length(struct queue *q)
+{
+	unsigned long head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	long len = (long)(__atomic_load_n(&q->tail, __ATOMIC_RELAXED) - head);
+
+	return len < 0 ? 0 : len;
+}
+
+/* returns 1 if no values are waiting to be taken */
+int
+queue_empty(struct queue *q)
+{
+	return queue_length(q) == 0;
+}
+
+/* makes every waiting and future queue_pop return -1 */
+void
+queue_close(struct queue *q)
+{
+	__atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&q->not_empty.epoch, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&q->not_empty.epoch, INT_MAX);
+}
+
+/* values left in the queue are dropped */
+void
+queue_destroy(struct queue *q)
+{
+	free(q->cells);
+	free(q);
+}
+
+/*
+ * A queue set gives every worker a queue of its own. Producers add each
+ * value to the least loaded queue, so workers mostly take values from their
+ * own queue and do not contend on a shared head. A worker whose queue is
+ * empty steals from the others before it goes to sleep.
+ *
+ * A worker's load is the length of its queue, plus one unless it is idle,
+ * i.e., looking for a value. When a value lands on the queue of a busy
+ * worker, the producer also wakes an idle worker so that it can steal the
+ * value.
+ */
+
+struct queue_set_member {
+	struct queue *queue;
+	int idle;	/* the owner is looking for a value */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct queue_set {
+	struct queue_set_member *members;
+	int nr_queues;
+	unsigned int next;	/* where producers start looking, so that
+				 * equally loaded queues take turns */
+};
+
+/* creates nr_queues queues that hold capacity values each */
+struct queue_set *
+queue_set_init(int nr_queues, int capacity)
+{
+	struct queue_set *qs = Malloc(sizeof(struct queue_set));
+	int i, ret;
+
+	assert(nr_queues > 0);
+	ret = posix_memalign((void **)&qs->members, CACHE_LINE,
+			     nr_queues * sizeof(struct queue_set_member));
+	assert(ret == 0 && qs->members);
+	for (i = 0; i < nr_queues; i++) {
+		qs->members[i].queue = queue_init(capacity);
+		qs->members[i].idle = 1;
+	}
+	qs->nr_queues = nr_queues;
+	qs->next = 0;
+	return qs;
+}
+
+/* adds value to the least loaded queue, waiting while it is full */
+void
+queue_set_push(struct queue_set *qs, int value)
+{
+	unsigned int start = __atomic_fetch_add(&qs->next, 1, __ATOMIC_RELAXED);
+	struct queue_set_member *m;
+	long load, best_load = LONG_MAX;
+	int i, k, best = 0;
+
+	for (k = 0; k < qs->nr_queues; k++) {
+		i = (start + k) % qs->nr_queues;
+		m = &qs->members[i];
+		load = queue_length(m->queue) +
+			!__atomic_load_n(&m->idle, __ATOMIC_RELAXED);
+		if (load < best_load) {
+			best = i;
+			best_load = load;
+			if (load == 0)
+				break;
+		}
+	}
+	m = &qs->members[best];
+	queue_push_wait(m->queue, value);
+	/* the fence in eventcount_signal orders the push before the reads of
+	 * the idle flags below. a worker that becomes idle later looks at
+	 * every queue after setting its flag, so it finds the value */
+	eventcount_signal(&m->queue->not_empty, 1);
+	if (__atomic_load_n(&m->idle, __ATOMIC_RELAXED))
+		return;
+	for (k = 1; k < qs->nr_queues; k++) {
+		struct queue_set_member *t =
+			&qs->members[(best + k) % qs->nr_queues];
+		if (__atomic_load_n(&t->idle, __ATOMIC_RELAXED)) {
+			eventcount_signal(&t->queue->not_empty, 1);
+			break;
+		}
+	}
+}
+
+/* takes a value from queue self, or steals one from another queue. returns
+ * -1 if all queues are empty */
+static int
+queue_set_try_pop(struct queue_set *qs, int self, struct queue **from)
+{
+	int i, k, value;
+
+	for (k = 0; k < qs->nr_queues; k++) {
+		i = (self + k) % qs->nr_queues;
+		*from = qs->members[i].queue;
+		if ((value = queue_try_pop(*from)) >= 0)
+			return value;
+	}
+	return -1;
+}
+
+/* takes the oldest value from queue self, or from another queue if self is
+ * empty, waiting while all queues are empty. returns -1 once the set is
+ * closed */
+int
+queue_set_pop(struct queue_set *qs, int self)
+{
+	struct queue_set_member *m = &qs->members[self];
+	struct queue *q = m->queue, *from;
+	int value;
+
+	while (1) {
+		int epoch;
+
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE))
+			return -1;
+		if ((value = queue_set_try_pop(qs, self, &from)) >= 0)
+			break;
+		__atomic_store_n(&m->idle, 1, __ATOMIC_RELAXED);
+		epoch = eventcount_prepare(&q->not_empty);
+		if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+			eventcount_cancel(&q->not_empty);
+			return -1;
+		}
+		if ((value = queue_set_try_pop(qs, self, &from)) >= 0) {
+			eventcount_cancel(&q->not_empty);
+			break;
+		}
+		eventcount_wait(&q->not_empty, epoch, NULL);
+	}
+	__atomic_store_n(&m->idle, 0, __ATOMIC_RELAXED);
+	eventcount_signal(&from->not_full, 1);
+	return value;
+}
+
+/* returns the number of values waiting in all the queues */
+long
+queue_set_length(struct queue_set *qs)
+{
+	long len = 0;
+	int i;
+
+	for (i = 0; i < qs->nr_queues; i++) {
+		len += queue_length(qs->members[i].queue);
+	}
+	return len;
+}
+
+/* returns 1 if no values are waiting in any queue */
+int
+queue_set_empty(struct queue_set *qs)
+{
+	int i;
+
+	for (i = 0; i < qs->nr_queues; i++) {
+		if (!queue_empty(qs->members[i].queue))
+			return 0;
+	}
+	return 1;
+}
+
+/* makes every waiting and future queue_set_pop return -1 */
+void
+queue_set_close(struct queue_set *qs)
+{
+	int i;
+
+	for (i = 0; i < qs->nr_queues; i++) {
+		queue_close(qs->members[i].queue);
+	}
+}
+
+/* values left in the queues are dropped */
+void
+queue_set_destroy(struct queue_set *qs)
+{
+	int i;
+
+	for (i = 0; i < qs->nr_queues; i++) {
+		queue_destroy(qs->members[i].queue);
+	}
+	free(qs->members);
+	free(qs);
+}
+
+/*
+ * A priority queue hands out the value with the smallest key first. It is a
+ * binary min-heap under a lock. Values with equal keys come out in no
+ * particular order.
+ */
+
+struct pqueue_entry {
+	long key;
+	int value;
+};
+
+struct pqueue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct pqueue_entry *heap;
+	int capacity;
+	int size;
+	int closed;
+};
+
+struct pqueue *
+pqueue_init(int capacity)
+{
+	struct pqueue *pq = Malloc(sizeof(struct pqueue));
+
+	assert(capacity > 0);
+	pthread_mutex_init(&pq->lock, NULL);
+	pthread_cond_init(&pq->not_empty, NULL);
+	pthread_cond_init(&pq->not_full, NULL);
+	pq->heap = Malloc(capacity * sizeof(struct pqueue_entry));
+	pq->capacity = capacity;
+	pq->size = 0;
+	pq->closed = 0;
+	return pq;
+}
+
+static void
+pqueue_swap(struct pqueue *pq, int i, int j)
+{
+	struct pqueue_entry tmp = pq->heap[i];
+
+	pq->heap[i] = pq->heap[j];
+	pq->heap[j] = tmp;
+}
+
+/* adds value with the given key, waiting while the queue is full */
+void
+pqueue_push(struct pqueue *pq, int value, long key)
+{
+	int i;
+
+	assert(value >= 0);
+	pthread_mutex_lock(&pq->lock);
+	while (pq->size == pq->capacity) {
+		pthread_cond_wait(&pq->not_full, &pq->lock);
+	}
+	i = pq->size++;
+	pq->heap[i].key = key;
+	pq->heap[i].value = value;
+	while (i > 0 && pq->heap[(i - 1) / 2].key > pq->heap[i].key) {
+		pqueue_swap(pq, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	pthread_cond_signal(&pq->not_empty);
+	pthread_mutex_unlock(&pq->lock);
+}
+
+/* takes the value with the smallest key, waiting while the queue is empty.
+ * returns -1 once the queue is closed, even if values are left */
+int
+pqueue_pop(struct pqueue *pq)
+{
+	int i, value = -1;
+
+	pthread_mutex_lock(&pq->lock);
+	while (pq->size == 0 && !pq->closed) {
+		pthread_cond_wait(&pq->not_empty, &pq->lock);
+	}
+	if (pq->closed)
+		goto out;
+	value = pq->heap[0].value;
+	pq->heap[0] = pq->heap[--pq->size];
+	i = 0;
+	while (1) {
+		int l = 2 * i + 1, r = l + 1, min = i;
+
+		if (l < pq->size && pq->heap[l].key < pq->heap[min].key)
+			min = l;
+		if (r < pq->size && pq->heap[r].key < pq->heap[min].key)
+			min = r;
+		if (min == i)
+			break;
+		pqueue_swap(pq, i, min);
+		i = min;
+	}
+	pthread_cond_signal(&pq->not_full);
+out:
+	pthread_mutex_unlock(&pq->lock);
+	return value;
+}
+
+/* returns the number of values waiting to be taken */
+long
+pqueue_length(struct pqueue *pq)
+{
+	long len;
+
+	pthread_mutex_lock(&pq->lock);
+	len = pq->size;
+	pthread_mutex_unlock(&pq->lock);
+	return len;
+}
+
+/* returns 1 if no values are waiting to be taken */
+int
+pqueue_empty(struct pqueue *pq)
+{
+	return pqueue_length(pq) == 0;
+}
+
+/* makes every waiting and future pqueue_pop return -1 */
+void
+pqueue_close(struct pqueue *pq)
+{
+	pthread_mutex_lock(&pq->lock);
+	pq->closed = 1;
+	pthread_cond_broadcast(&pq->not_empty);
+	pthread_mutex_unlock(&pq->lock);
+}
+
+/* values left in the queue are dropped */
+void
+pqueue_destroy(struct pqueue *pq)
+{
+	pthread_mutex_destroy(&pq->lock);
+	pthread_cond_destroy(&pq->not_empty);
+	pthread_cond_destroy(&pq->not_full);
+	free(pq->heap);
+	free(pq);
+}
@@ -0,0 +1,41 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+struct queue;
+
+struct queue *queue_init(int capacity);
+void queue_push(struct queue *q, int value);
+int queue_pop(struct queue *q);
+int queue_push_nowait(struct queue *q, int value);
+int queue_pop_nowait(struct queue *q);
+/* returned by queue_pop_timeout */
+#define QUEUE_TIMEDOUT (-2)
+int queue_pop_timeout(struct queue *q, int timeout);
+long queue_length(struct queue *q);
+int queue_empty(struct queue *q);
+void queue_close(struct queue *q);
+void queue_destroy(struct queue *q);
+
+/* one queue per worker, with work stealing */
+struct queue_set;
+
+struct queue_set *queue_set_init(int nr_queues, int capacity);
+void queue_set_push(struct queue_set *qs, int value);
+int queue_set_pop(struct queue_set *qs, int self);
+long queue_set_length(struct queue_set *qs);
+int queue_set_empty(struct queue_set *qs);
+void queue_set_close(struct queue_set *qs);
+void queue_set_destroy(struct queue_set *qs);
+
+/* smallest key first */
+struct pqueue;
+
+struct pqueue *pqueue_init(int capacity);
+void pqueue_push(struct pqueue *pq, int value, long key);
+int pqueue_pop(struct pqueue *pq);
+long pqueue_length(struct pqueue *pq);
+int pqueue_empty(struct pqueue *pq);
+void pqueue_close(struct pqueue *pq);
+void pqueue_destroy(struct pqueue *pq);
+
+#endif /* __QUEUE_H__ */
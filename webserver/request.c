@@ -2,14 +2,46 @@
  * request.c: Does the bulk of the work for the web server.
  */
 
+/* for strcasestr */
+#define _GNU_SOURCE
+
 #include "common.h"
 #include "request.h"
+#include "bytesum.h"
+#include "trace.h"
+
+/* a client connection. with HTTP/1.1 keep-alive, a connection carries any
+ * number of requests, which may be pipelined, so the read buffer belongs to
+ * the connection rather than to a request. */
+struct connection {
+	int fd;		 /* descriptor for client connection */
+	struct rio *rio;
+};
 
 struct request {
 	int fd;		 /* descriptor for client connection */
+	struct connection *conn;
 	struct file_data *data;
+	int file_fd;	 /* file the body is streamed from, or -1 */
+	int keep_alive;	 /* the client wants the connection kept open */
+	int stats;	 /* the request is for the server statistics */
 };
 
+/* requests for this URI get the server statistics rather than a file */
+#define STATS_URI "/__stats"
+/* files are named by their uri after this prefix */
+#define URI_PREFIX "./"
+
+/* sent as is to connections that the server is too busy to serve */
+static char overloaded[] = "HTTP/1.1 503 Service Unavailable\r\n"
+	"Content-Length: 0\r\n"
+	"Retry-After: 1\r\n"
+	"Connection: close\r\n\r\n";
+
+/* ends the header block of a response */
+static char connection_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+static char connection_close[] = "Connection: close\r\n\r\n";
+
 /* requestError(fd, filename, "404", "Not found", 
  *		"OS server could not find this file");
  */
@@ -19,26 +51,30 @@ request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 	char buf[MAXLINE], body[MAXBUF];
 	int i;
 	unsigned int csum = 0;
+	long size = 0;
+
+	TRACE(TRACE_ERROR, TRACE_HTTP_ERROR, atoi(errnum), fd, cause);
 
 	/* create the body of the error message */
-	sprintf(body, "<html><title>OS Web Server Error</title>");
-	sprintf(body, "%s<body bgcolor=" "fffff" ">\r\n", body);
-	sprintf(body, "%s<p>%s: %s</p>\r\n", body, errnum, shortmsg);
-	sprintf(body, "%s<p>%s: %s</p>\r\n", body, longmsg, cause);
-	sprintf(body, "%s</body></html>\r\n", body);
+	size += sprintf(body + size, "<html><title>OS Web Server Error</title>");
+	size += sprintf(body + size, "<body bgcolor=" "fffff" ">\r\n");
+	size += sprintf(body + size, "<p>%s: %s</p>\r\n", errnum, shortmsg);
+	size += sprintf(body + size, "<p>%s: %s</p>\r\n", longmsg, cause);
+	size += sprintf(body + size, "</body></html>\r\n");
 
 	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+	sprintf(buf, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
 	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
 
 	sprintf(buf, "Content-Type: text/html\r\n");
 	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
 
 	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
 	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+
+	/* the connection is always closed after an error */
+	sprintf(buf, "Connection: close\r\n");
+	Rio_write(fd, buf, strlen(buf));
 
 	/* generate a very trivial checksum */
 	for (i = 0; i < strlen(body); i++) {
@@ -46,25 +82,29 @@ request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 	}
 	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
 	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
 
 	/* write out the content */
 	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
-
 }
 
-/* reads and discards everything up to an empty text line */
-static void
-request_read_headers(struct rio *rp)
+/* reads everything up to an empty text line, and returns whether the
+ * client asked for the connection to be kept open. HTTP/1.1 connections
+ * are persistent unless the client sends "Connection: close", HTTP/1.0
+ * connections only if it sends "Connection: keep-alive". */
+static int
+request_read_headers(struct rio *rp, int keep_alive)
 {
 	char buf[MAXLINE];
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	while (Rio_readlineb(rp, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+		if (strncasecmp(buf, "Connection:", 11) == 0) {
+			if (strcasestr(buf + 11, "close"))
+				keep_alive = 0;
+			else if (strcasestr(buf + 11, "keep-alive"))
+				keep_alive = 1;
+		}
 	}
-	return;
+	return keep_alive;
 }
 
 
@@ -78,7 +118,14 @@ request_read_headers(struct rio *rp)
 static void
 request_parse_URI(char *uri, char *filename, size_t max)
 {
-	snprintf(filename, max, "./%s", uri);
+	snprintf(filename, max, URI_PREFIX "%s", uri);
+}
+
+/* fills file_name with the name of the file that uri is served from */
+void
+request_file_name(char *uri, char *file_name, int max)
+{
+	request_parse_URI(uri, file_name, max);
 }
 
 /* Fills in the filetype given the filename */
@@ -95,59 +142,335 @@ request_get_file_type(char *filename, char *filetype)
 		strcpy(filetype, "text/plain");
 }
 
+/* builds the response header block for the file, given its checksum. the
+ * header depends only on the file name and contents, so it is built once when
+ * the file is read, and is cached along with the file. */
+static void
+file_data_prepare(struct file_data *data, unsigned int csum)
+{
+	char filetype[32], buf[MAXBUF];
+	int size = 0;
+
+	request_get_file_type(data->file_name, filetype);
+	/* put together response */
+	size += sprintf(buf + size, "HTTP/1.1 200 OK\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
+	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
+	/* the Connection header and the empty line that ends the header block
+	 * depend on the request, and are added by request_sendfile */
+	size += sprintf(buf + size, "Content-Csum: %u\r\n", csum);
+
+	data->header = Malloc(size);
+	memcpy(data->header, buf, size);
+	data->header_size = size;
+}
+
+/* checksums of streamed files, so that a file is only read through user
+ * space the first time it is streamed. a slot is reused when its file
+ * changes, or when another file maps to the same slot. */
+#define CSUM_TABLE_SIZE 1024
+/* size of the buffer used to checksum a streamed file */
+#define CSUM_CHUNK_SIZE 65536
+
+struct csum_slot {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	unsigned int csum;
+	int valid;
+};
+
+static struct csum_slot csum_table[CSUM_TABLE_SIZE];
+static pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+csum_slot_matches(struct csum_slot *slot, struct stat *sbuf)
+{
+	return slot->valid && slot->dev == sbuf->st_dev &&
+		slot->ino == sbuf->st_ino && slot->size == sbuf->st_size &&
+		slot->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+		slot->mtime.tv_nsec == sbuf->st_mtim.tv_nsec;
+}
+
+/* returns the checksum of the open file described by sbuf, reading the
+ * file a chunk at a time if it is not in the table */
+static unsigned int
+request_file_csum(int fd, struct stat *sbuf)
+{
+	struct csum_slot *slot;
+	unsigned int csum = 0;
+	off_t offset = 0;
+	ssize_t n;
+	char *buf;
+
+	slot = &csum_table[(sbuf->st_ino ^ (sbuf->st_dev * 31)) % CSUM_TABLE_SIZE];
+	pthread_mutex_lock(&csum_lock);
+	if (csum_slot_matches(slot, sbuf)) {
+		csum = slot->csum;
+		pthread_mutex_unlock(&csum_lock);
+		return csum;
+	}
+	pthread_mutex_unlock(&csum_lock);
+
+	buf = Malloc(CSUM_CHUNK_SIZE);
+	while (offset < sbuf->st_size) {
+		SYS(n = pread(fd, buf, CSUM_CHUNK_SIZE, offset));
+		if (n == 0)
+			break;
+		csum += bytesum(buf, n);
+		offset += n;
+	}
+	free(buf);
+
+	pthread_mutex_lock(&csum_lock);
+	slot->dev = sbuf->st_dev;
+	slot->ino = sbuf->st_ino;
+	slot->size = sbuf->st_size;
+	slot->mtime = sbuf->st_mtim;
+	slot->csum = csum;
+	slot->valid = 1;
+	pthread_mutex_unlock(&csum_lock);
+	return csum;
+}
+
 /* entry point to this file */
-/* returns a pointer to a request struct, filling rq->fd with connfd,
- * and rq->file_name with the file that is being requested.
- * Returns NULL on failure.
+
+/* initialize file data, with one reference held by the caller */
+struct file_data *
+file_data_init(void)
+{
+	struct file_data *data;
+
+	data = Malloc(sizeof(struct file_data));
+	data->file_name = NULL;
+	data->file_buf = NULL;
+	data->file_size = 0;
+	data->header = NULL;
+	data->header_size = 0;
+	data->refcount = 1;
+	data->mtime.tv_sec = 0;
+	data->mtime.tv_nsec = 0;
+	data->mapped = 0;
+	return data;
+}
+
+/* take another reference to file data */
+struct file_data *
+file_data_get(struct file_data *data)
+{
+	__sync_fetch_and_add(&data->refcount, 1);
+	return data;
+}
+
+/* drop a reference to file data, freeing it when the last one is gone */
+void
+file_data_put(struct file_data *data)
+{
+	if (__sync_sub_and_fetch(&data->refcount, 1) > 0)
+		return;
+	free(data->file_name);
+	if (!data->mapped) {
+		free(data->file_buf);
+		free(data->header);
+	}
+	free(data);
+}
+
+/* starts reading requests from connfd */
+struct connection *
+connection_init(int connfd)
+{
+	struct connection *conn;
+
+	conn = Malloc(sizeof(struct connection));
+	conn->fd = connfd;
+	conn->rio = Rio_init(connfd);
+	return conn;
+}
+
+/* waits up to timeout ms for the next request on the connection. returns 1
+ * if a request, possibly pipelined behind the last one, is ready to be
+ * read, 0 on timeout and -1 if the connection failed. */
+int
+connection_wait(struct connection *conn, int timeout)
+{
+	return Rio_wait(conn->rio, timeout);
+}
+
+void
+connection_destroy(struct connection *conn)
+{
+	assert(conn);
+	Rio_destroy(conn->rio);
+	/* send the FIN first. if the client's next request crossed an idle
+	 * close, close() with unread data sends a reset, and the client
+	 * should see the connection closed rather than reset. this fails
+	 * harmlessly if the client already reset the connection. */
+	shutdown(conn->fd, SHUT_WR);
+	/* close the connection fd */
+	SYS(close(conn->fd));
+	free(conn);
+}
+
+/* returns a pointer to a request struct for the next request on conn,
+ * filling rq->file_name with the file that is being requested.
+ * Returns NULL on failure, or when the client closed the connection.
  */
 struct request *
-request_init(int connfd, struct file_data *data)
+request_init(struct connection *conn, struct file_data *data)
 {
 	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
 	struct request *rq;
 
 	assert(data);
+	if (Rio_readlineb(conn->rio, buf, MAXLINE) == 0) {
+		/* the client closed the connection */
+		return NULL;
+	}
 	rq = Malloc(sizeof(struct request));
-	rq->fd = connfd;
+	rq->fd = conn->fd;
+	rq->conn = conn;
 	rq->data = data;
+	rq->file_fd = -1;
+	rq->stats = 0;
 	data->file_name = Malloc(MAXLINE);
 	data->file_buf = NULL;
 	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
+	data->header = NULL;
+	method[0] = uri[0] = version[0] = '\0';
 	sscanf(buf, "%s %s %s", method, uri, version);
 
-	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
+	// printf("%s %s %s, fd = %d\n", method, uri, version, conn->fd);
 	if (strcasecmp(method, "GET")) {
 		request_error(rq->fd, method, "501", "Not Implemented",
 			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
+	rq->keep_alive = request_read_headers(conn->rio,
+					      strcasecmp(version, "HTTP/1.1") == 0);
+	rq->stats = strcmp(uri, STATS_URI) == 0;
 	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
 	return rq;
 }
 
+/* looks at the request line of the next request on connfd without reading
+ * it, fills file_name with the requested file and returns its size. returns
+ * -1 if the request line has not fully arrived, or if there is no such
+ * file. this lets the server schedule a connection before a worker reads
+ * its request. */
+long
+request_peek(int connfd, char *file_name, int max)
+{
+	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+	struct stat sbuf;
+	ssize_t n;
+
+	n = recv(connfd, buf, MAXLINE - 1, MSG_PEEK | MSG_DONTWAIT);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	if (strchr(buf, '\n') == NULL ||
+	    sscanf(buf, "%s %s", method, uri) != 2)
+		return -1;
+	request_parse_URI(uri, file_name, max);
+	if (stat(file_name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode))
+		return -1;
+	return sbuf.st_size;
+}
+
+/* tells the client on connfd that the server is overloaded, and closes the
+ * connection. this never blocks, so the acceptor can turn connections away
+ * as fast as they arrive. */
+void
+request_reject(int connfd)
+{
+	char buf[MAXLINE];
+
+	/* read whatever part of the request has arrived, so that closing the
+	 * connection does not reset it before the client reads the 503 */
+	while (recv(connfd, buf, MAXLINE, MSG_DONTWAIT) > 0);
+	/* a client that is gone, or a full socket buffer, only loses the 503 */
+	send(connfd, overloaded, sizeof(overloaded) - 1,
+	     MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(connfd, SHUT_WR);
+	SYS(close(connfd));
+}
+
+/* returns 1 if rq asks for the server statistics, which the server sends
+ * with request_set_body */
+int
+request_stats(struct request *rq)
+{
+	return rq->stats;
+}
+
+/* returns the uri that rq asked for */
+const char *
+request_uri(struct request *rq)
+{
+	return rq->data->file_name + strlen(URI_PREFIX);
+}
+
+/* returns 1 if the connection should stay open after this request */
+int
+request_keep_alive(struct request *rq)
+{
+	return rq->keep_alive;
+}
+
+/* the connection stays open, so this does not close rq->fd */
 void
 request_destroy(struct request *rq)
 {
 	assert(rq);
-	/* close the connection fd */
-	SYS(close(rq->fd));
+	if (rq->file_fd >= 0) {
+		/* ask the kernel to stop caching the file, like
+		 * request_readfile does */
+		SYS(posix_fadvise(rq->file_fd, 0, 0, POSIX_FADV_DONTNEED));
+		SYS(close(rq->file_fd));
+	}
 	free(rq);
 }
 
+/* reads data->file_size bytes of data->file_name into data->file_buf, and
+ * builds the response header */
+static void
+file_data_read(struct file_data *data)
+{
+	int srcfd;
+
+	if (data->file_size) {
+		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
+		data->file_buf = Malloc(data->file_size);
+		Rio_read(srcfd, data->file_buf, data->file_size);
+		/* ask the kernel to stop caching the file */
+		SYS(posix_fadvise(srcfd, 0, data->file_size, 
+				  POSIX_FADV_DONTNEED));
+		SYS(close(srcfd));
+		/* we do this to simulate a slow disk. otherwise, file caching
+		 * doesn't have much benefit because a lot of the time is spent
+		 * in processing (see request_processfile below) and so
+		 * request_readfile does not have much impact. */
+		usleep(10000);
+	}
+	/* generate a very trivial checksum */
+	file_data_prepare(data, bytesum(data->file_buf, data->file_size));
+}
+
 /* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
+ * Returns 1 on success, and fills rq->file_buf, rq->file_size and the
+ * response header.
+ * Returns 0 on failure, sends error to client.
+ *
+ * If max_buffered >= 0, files larger than max_buffered bytes are not read
+ * into memory. They are opened instead, and request_sendfile streams them
+ * to the client straight from the file (see request_streamed). */
 int
-request_readfile(struct request *rq)
+request_readfile(struct request *rq, long max_buffered)
 {
-	int srcfd;
 	struct stat sbuf;
 	struct file_data *data;
 	char *ext;
@@ -189,24 +512,71 @@ request_readfile(struct request *rq)
 	}
 
 	data->file_size = sbuf.st_size;
+	data->mtime = sbuf.st_mtim;
 
-	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
-		/* we do this to simulate a slow disk. otherwise, file caching
-		 * doesn't have much benefit because a lot of the time is spent
-		 * in processing (see request_processfile below) and so
-		 * request_readfile does not have much impact. */
+	if (max_buffered >= 0 && data->file_size > max_buffered) {
+		SYS(rq->file_fd = open(data->file_name, O_RDONLY, 0));
+		file_data_prepare(data, request_file_csum(rq->file_fd, &sbuf));
+		/* simulate a slow disk, as below */
 		usleep(10000);
+		return 1;
 	}
+
+	file_data_read(data);
 	return 1;
 }
 
+/* reads the file for uri into new file data, as request_readfile would for
+ * a request for uri, so that the cache can be filled before any request
+ * arrives. returns NULL if the file would not be served, or if it is larger
+ * than max_size bytes. */
+struct file_data *
+file_data_load(char *uri, long max_size)
+{
+	char file_name[MAXLINE];
+	struct file_data *data;
+	struct stat sbuf;
+	char *ext;
+
+	request_parse_URI(uri, file_name, MAXLINE);
+	if (strstr(file_name, "..") != NULL)
+		return NULL;
+	if (((ext = strrchr(file_name, '.')) != NULL) &&
+	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0)))
+		return NULL;
+	if (stat(file_name, &sbuf) < 0 || !(S_ISREG(sbuf.st_mode)) ||
+	    !(S_IRUSR & sbuf.st_mode) || sbuf.st_size > max_size)
+		return NULL;
+
+	data = file_data_init();
+	data->file_name = strdup(file_name);
+	assert(data->file_name);
+	data->file_size = sbuf.st_size;
+	data->mtime = sbuf.st_mtim;
+	file_data_read(data);
+	return data;
+}
+
+/* returns 1 if the file will be streamed from disk rather than sent from
+ * data->file_buf. streamed file data must not be cached. */
+int
+request_streamed(struct request *rq)
+{
+	return rq->file_fd >= 0;
+}
+
+/* makes the size bytes at buf the body of the response, in place of a
+ * file. buf is freed along with the file data, which must not be cached. */
+void
+request_set_body(struct request *rq, char *buf, int size)
+{
+	struct file_data *data = rq->data;
+
+	data->file_buf = buf;
+	data->file_size = size;
+	file_data_prepare(data, bytesum(buf, size));
+}
+
 /* if you have previous file data, you can reuse it */
 void
 request_set_data(struct request *rq, struct file_data *data)
@@ -218,53 +588,57 @@ request_set_data(struct request *rq, struct file_data *data)
  * processing on the file, the network becomes the bottleneck, and then the
  * various server parameters have no affect on server performance. this is a
  * problem because we have 100 Mb/s network. With faster networks, we wouldn't
- * have to do this artificial work. */
-static void
+ * have to do this artificial work. call this before request_sendfile. a
+ * streamed file is copied to the socket by the kernel, so there is no buffer
+ * to process. */
+void
 request_processfile(struct request *rq)
 {
 	struct file_data *data;
-	int i, j, dummy;
+	int i;
+	unsigned int dummy = 0;
 	data = rq->data;
 	assert(data);
 
+	if (request_streamed(rq))
+		return;
 	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
-		}
+		dummy += bytesum(data->file_buf, data->file_size);
 	}
 }
 
-/* send filename to the fd connection */
-void
+/* send filename to the fd connection. the header was built when the file
+ * was read, so a cache hit only writes out the header, the Connection
+ * header and the file. returns 0 if the response could not be sent in full,
+ * as when the client has gone away or a streamed file shrank, in which case
+ * the connection should be closed. */
+int
 request_sendfile(struct request *rq)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
-	unsigned int csum = 0;
 	struct file_data *data;
-	long size = 0;
+	struct iovec iov[3];
 
 	data = rq->data;
-	assert(data);
-
-	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	assert(data && data->header);
+
+	iov[0].iov_base = data->header;
+	iov[0].iov_len = data->header_size;
+	if (rq->keep_alive) {
+		iov[1].iov_base = connection_keep_alive;
+		iov[1].iov_len = sizeof(connection_keep_alive) - 1;
+	} else {
+		iov[1].iov_base = connection_close;
+		iov[1].iov_len = sizeof(connection_close) - 1;
 	}
-	/* do some processing */
-	request_processfile(rq);
-	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
-	size += sprintf(buf + size, "Server: OS Web Server\r\n");
-	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
 
-	Rio_write(rq->fd, buf, strlen(buf));
-
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+	if (request_streamed(rq)) {
+		return rio_writev(rq->fd, iov, 2) >= 0 &&
+			rio_sendfile(rq->fd, rq->file_fd, data->file_size) ==
+			data->file_size;
 	}
+
+	/* writes the header and data->file_buf to the client socket */
+	iov[2].iov_base = data->file_buf;
+	iov[2].iov_len = data->file_size;
+	return rio_writev(rq->fd, iov, data->file_size > 0 ? 3 : 2) >= 0;
 }
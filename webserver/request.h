@@ -1,16 +1,42 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <time.h>
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	char *header;	 /* response header lines, built once the file is read */
+	int header_size;
+	int refcount;	 /* references held by the cache and by requests */
+	struct timespec mtime;	/* modification time of the file when read */
+	int mapped;	 /* file_buf and header point into a snapshot mapping,
+			  * and are not freed with the data */
 };
 
-struct request *request_init(int connfd, struct file_data *data);
-int request_readfile(struct request *rq);
+struct file_data *file_data_init(void);
+struct file_data *file_data_get(struct file_data *data);
+void file_data_put(struct file_data *data);
+struct file_data *file_data_load(char *uri, long max_size);
+void request_file_name(char *uri, char *file_name, int max);
+
+struct connection *connection_init(int connfd);
+int connection_wait(struct connection *conn, int timeout);
+void connection_destroy(struct connection *conn);
+
+long request_peek(int connfd, char *file_name, int max);
+void request_reject(int connfd);
+struct request *request_init(struct connection *conn, struct file_data *data);
+int request_keep_alive(struct request *rq);
+int request_stats(struct request *rq);
+const char *request_uri(struct request *rq);
+int request_readfile(struct request *rq, long max_buffered);
+int request_streamed(struct request *rq);
 void request_set_data(struct request *rq, struct file_data *data);
-void request_sendfile(struct request *rq);
+void request_set_body(struct request *rq, char *buf, int size);
+void request_processfile(struct request *rq);
+int request_sendfile(struct request *rq);
 void request_destroy(struct request *rq);
 
 #endif
@@ -1,26 +1,81 @@
+/* for accept4 */
+#define _GNU_SOURCE
 #include <malloc.h>
+#include <popt.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "cache.h"
+#include "trace.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [options] portnum nr_threads max_requests max_cache_size
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
  */
 
+poptContext context;	/* context for parsing command-line options */
+
+/* the cache is split into this many independently locked shards */
+#define DEFAULT_NR_CACHE_SHARDS 1
+/* eviction policy: lru, clock, arc, s3fifo or gds */
+#define DEFAULT_CACHE_POLICY "lru"
+/* ms that a keep-alive connection may stay idle before it is closed */
+#define DEFAULT_IDLE_TIMEOUT 5000
+
+/* what server_init sets up. options that the server threads do not need to
+ * know about, or that are given as strings, are kept below */
+static struct server_options opts = {
+	.nr_cache_shards = DEFAULT_NR_CACHE_SHARDS,
+	.cache_policy = DEFAULT_CACHE_POLICY,
+	.idle_timeout = DEFAULT_IDLE_TIMEOUT,
+	.overload = OVERLOAD_BLOCK,
+};
+
+/* with more than one acceptor, each acceptor thread has its own
+ * SO_REUSEPORT listening socket */
+#define DEFAULT_NR_ACCEPTORS 1
+static int nr_acceptors = DEFAULT_NR_ACCEPTORS;
+/* thread pool sizes of the parse, io and send stages, e.g., 1,8,2. with
+ * staged processing, nr_threads is not used */
+static char *stages = NULL;
+/* bounds of the adaptive worker pool, e.g., 4,64. nr_threads is the
+ * number of workers to start with */
+static char *pool = NULL;
+/* what to do with new connections when the queue is full: block, reject or
+ * drop-oldest */
+#define DEFAULT_OVERLOAD "block"
+static char *overload = DEFAULT_OVERLOAD;
+static const char *overload_names[] = { "block", "reject", "drop-oldest" };
+/* on exit, write the events traced at or below the trace level here */
+static char *trace_file = NULL;
+#define DEFAULT_TRACE_LEVEL "info"
+static char *verbosity = DEFAULT_TRACE_LEVEL;
+
 static void
-usage(char *program)
+usage(void)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	poptPrintUsage(context, stderr, 0);
 	exit(1);
 }
 
+/* returns the next positional argument as an integer */
+static int
+int_arg(void)
+{
+	const char *arg = poptGetArg(context);
+
+	if (arg == NULL)
+		usage();
+	return atoi(arg);
+}
+
 static char *fifo = "./server_exit";
 
 /* we will use this fifo to send a message to the server to exit */
@@ -52,60 +107,289 @@ close_fifo(void)
 	unlink(fifo);
 }
 
+struct acceptor {
+	pthread_t thread;
+	struct server *sv;
+	int listenfd;
+	int exitfd;
+};
+
+/* accepts connections on a non-blocking listening socket until the exit
+ * fifo becomes readable. every wakeup drains all pending connections, so a
+ * burst of connections costs one epoll_wait rather than one poll each. */
+static void *
+acceptor_loop(void *arg)
+{
+	struct acceptor *ac = arg;
+	struct epoll_event ev, events[2];
+	int epfd, connfd, i, n;
+	int exiting = 0;
+
+	SYS(fcntl(ac->listenfd, F_SETFL,
+		  fcntl(ac->listenfd, F_GETFL, 0) | O_NONBLOCK));
+	SYS(epfd = epoll_create1(EPOLL_CLOEXEC));
+	ev.events = EPOLLIN;
+	ev.data.fd = ac->exitfd;
+	SYS(epoll_ctl(epfd, EPOLL_CTL_ADD, ac->exitfd, &ev));
+	ev.data.fd = ac->listenfd;
+	SYS(epoll_ctl(epfd, EPOLL_CTL_ADD, ac->listenfd, &ev));
+
+	while (!exiting) {
+		/* wait for either a client to connect or an exit event */
+		n = epoll_wait(epfd, events, 2, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == ac->exitfd) {
+				/* exit requested */
+				exiting = 1;
+				continue;
+			}
+			/* connect requests arrived. the accepted sockets
+			 * are blocking, since the workers use blocking I/O */
+			while ((connfd = accept4(ac->listenfd, NULL, NULL,
+						 SOCK_CLOEXEC)) >= 0) {
+				/* serve the request */
+				server_request(ac->sv, connfd);
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED) {
+				SYS(connfd);
+			}
+		}
+	}
+	SYS(close(epfd));
+	SYS(close(ac->listenfd));
+	return NULL;
+}
+
 int
-main(int argc, char *argv[])
+main(int argc, const char *argv[])
 {
-	int port, nr_threads, max_requests, max_cache_size;
-	int listenfd, connfd, clientlen;
+	int port;
 	int exitfd;
-	struct sockaddr_in clientaddr;
+	int c, i;
+	struct acceptor *acceptors;
 	struct server *sv;
 
-	if (argc != 5)
-		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	struct poptOption options_table[] = {
+		{"cache-shards", 's', POPT_ARG_INT, &opts.nr_cache_shards, 's',
+		 "number of independently locked cache shards",
+		 " default: " STR(DEFAULT_NR_CACHE_SHARDS)},
+		{"admission", 'a', POPT_ARG_NONE, &opts.cache_admission, 'a',
+		 "enable the frequency-based (TinyLFU) cache admission filter",
+		 NULL},
+		{"policy", 'p', POPT_ARG_STRING, &opts.cache_policy, 'p',
+		 "cache eviction policy: lru, clock, arc, s3fifo or gds",
+		 " default: " DEFAULT_CACHE_POLICY},
+		{"zero-copy", 'z', POPT_ARG_NONE, &opts.zero_copy, 'z',
+		 "send files that are not cached straight from disk",
+		 NULL},
+		{"acceptors", 'A', POPT_ARG_INT, &nr_acceptors, 'A',
+		 "number of acceptor threads, each with its own "
+		 "SO_REUSEPORT socket",
+		 " default: " STR(DEFAULT_NR_ACCEPTORS)},
+		{"idle-timeout", 'k', POPT_ARG_INT, &opts.idle_timeout, 'k',
+		 "ms to keep an idle keep-alive connection open",
+		 " default: " STR(DEFAULT_IDLE_TIMEOUT)},
+		{"work-stealing", 'w', POPT_ARG_NONE, &opts.work_stealing, 'w',
+		 "queue connections per worker, with work stealing",
+		 NULL},
+		{"stages", 'S', POPT_ARG_STRING, &stages, 'S',
+		 "serve requests in parse, io and send stages with these "
+		 "numbers of threads", "parse,io,send"},
+		{"pool", 'P', POPT_ARG_STRING, &pool, 'P',
+		 "grow and shrink the worker pool within these bounds",
+		 "min,max"},
+		{"sjf", 'j', POPT_ARG_NONE, &opts.sjf, 'j',
+		 "serve queued connections shortest file first",
+		 NULL},
+		{"overload", 'o', POPT_ARG_STRING, &overload, 'o',
+		 "when the queue is full: block, reject new connections "
+		 "with a 503, or drop-oldest queued connection",
+		 " default: " DEFAULT_OVERLOAD},
+		{"warm-up", 'W', POPT_ARG_STRING, &opts.warmup_path, 'W',
+		 "fill the cache with the files in a fileset index or a hot "
+		 "file list before accepting connections", "file"},
+		{"save-hot", 'H', POPT_ARG_STRING, &opts.hot_path, 'H',
+		 "on exit, save the cached files to a hot file list, "
+		 "hottest first", "file"},
+		{"snapshot", 'C', POPT_ARG_STRING, &opts.snapshot_path, 'C',
+		 "start with the cache saved in a snapshot file, and save "
+		 "the cache to it on exit", "file"},
+		{"trace", 'T', POPT_ARG_STRING, &trace_file, 'T',
+		 "trace events into per-thread rings, and write them to a "
+		 "file for trace_decode on exit", "file"},
+		{"trace-level", 'L', POPT_ARG_STRING, &verbosity, 'L',
+		 "trace events up to this level: error, info or debug",
+		 " default: " DEFAULT_TRACE_LEVEL},
+		{"record", 'R', POPT_ARG_STRING, &opts.record_path, 'R',
+		 "record the arrival time and uri of each request to an "
+		 "access log that the client can replay", "file"},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	poptSetOtherOptionHelp(context,
+			       "port nr_threads max_requests max_cache_size");
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	port = int_arg();
+	opts.nr_threads = int_arg();
+	opts.max_requests = int_arg();
+	opts.max_cache_size = int_arg();
+	if (poptGetArg(context) != NULL)
+		usage();
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
-		usage(argv[0]);
+		usage();
 	}
-	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0) {
+	if (opts.nr_threads < 0 || opts.max_requests < 0 ||
+	    opts.max_cache_size < 0) {
 		fprintf(stderr, "arguments should be > 0\n");
-		usage(argv[0]);
+		usage();
 	}
+	if (opts.nr_cache_shards < 1) {
+		fprintf(stderr, "nr of cache shards should be > 0\n");
+		usage();
+	}
+	if (opts.idle_timeout < 0) {
+		fprintf(stderr, "idle timeout should be >= 0\n");
+		usage();
+	}
+	if (nr_acceptors < 1) {
+		fprintf(stderr, "nr of acceptors should be > 0\n");
+		usage();
+	}
+	if (stages) {
+		char end;
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
-
-	listenfd = open_listenfd(port);
-	exitfd = open_fifo();
+		if (sscanf(stages, "%d,%d,%d%c", &opts.stage_threads[0],
+			   &opts.stage_threads[1], &opts.stage_threads[2],
+			   &end) != 3 ||
+		    opts.stage_threads[0] < 1 || opts.stage_threads[1] < 1 ||
+		    opts.stage_threads[2] < 1) {
+			fprintf(stderr, "stages should be three thread "
+				"counts > 0, e.g., 1,8,2\n");
+			usage();
+		}
+		if (opts.work_stealing) {
+			fprintf(stderr, "work stealing does not apply to "
+				"stages\n");
+			usage();
+		}
+	}
+	if (pool) {
+		char end;
 
-	struct pollfd fds[] = {
-		{exitfd, POLLIN},
-		{listenfd, POLLIN},
-	};
-	while (1) {
-		/* wait for either a client to connect or an exit event */
-		SYS(poll(fds, 2, -1));
-		
-		if(fds[0].revents & POLLIN) { /* exit requested */
-			break;
+		if (sscanf(pool, "%d,%d%c", &opts.min_threads,
+			   &opts.max_threads, &end) != 2 ||
+		    opts.min_threads < 1 ||
+		    opts.max_threads < opts.min_threads) {
+			fprintf(stderr, "pool should be min,max with "
+				"0 < min <= max, e.g., 4,64\n");
+			usage();
+		}
+		if (opts.nr_threads < opts.min_threads ||
+		    opts.nr_threads > opts.max_threads ||
+		    opts.max_requests < 1) {
+			fprintf(stderr, "the pool needs min <= nr_threads <= "
+				"max and max_requests > 0\n");
+			usage();
+		}
+		if (opts.work_stealing || stages) {
+			fprintf(stderr, "the pool only applies to the shared "
+				"queue of workers\n");
+			usage();
 		}
+	}
+	if (opts.sjf && (opts.work_stealing || stages || pool)) {
+		fprintf(stderr, "shortest-job-first only applies to a fixed "
+			"pool with a shared queue\n");
+		usage();
+	}
+	for (opts.overload = OVERLOAD_BLOCK;
+	     opts.overload <= OVERLOAD_DROP_OLDEST; opts.overload++) {
+		if (strcmp(overload, overload_names[opts.overload]) == 0)
+			break;
+	}
+	if (opts.overload > OVERLOAD_DROP_OLDEST) {
+		fprintf(stderr, "unknown overload policy %s\n", overload);
+		usage();
+	}
+	if (opts.overload != OVERLOAD_BLOCK &&
+	    (opts.work_stealing || stages || opts.sjf)) {
+		fprintf(stderr, "overload policies only apply to the shared "
+			"queue of workers\n");
+		usage();
+	}
+	if ((opts.warmup_path || opts.hot_path || opts.snapshot_path) &&
+	    opts.max_cache_size == 0) {
+		fprintf(stderr, "warm-up, saving hot files and snapshots "
+			"need a cache\n");
+		usage();
+	}
+	if (trace_level_find(verbosity) < 0) {
+		fprintf(stderr, "unknown trace level %s\n", verbosity);
+		usage();
+	}
+	if (!cache_policy_exists(opts.cache_policy)) {
+		fprintf(stderr, "unknown cache policy %s\n", opts.cache_policy);
+		usage();
+	}
 
-		assert(fds[1].revents & POLLIN); /* connect request arrived */
-		clientlen = sizeof(clientaddr);
-		/* connfd is the socket descriptor the server will use to send
-		 * data to the client */
-		SYS(connfd = accept(listenfd, (struct sockaddr *)&clientaddr,
-				    (socklen_t *) & clientlen));
+	/* a write to a client that has gone away fails with EPIPE, which only
+	 * closes that connection */
+	signal(SIGPIPE, SIG_IGN);
+	if (trace_file)
+		trace_init(trace_level_find(verbosity));
+	sv = server_init(&opts);
 
-		/* serve the request */
-		server_request(sv, connfd);
+	exitfd = open_fifo();
+
+	acceptors = Malloc(nr_acceptors * sizeof(struct acceptor));
+	for (i = 0; i < nr_acceptors; i++) {
+		acceptors[i].sv = sv;
+		acceptors[i].exitfd = exitfd;
+		if (nr_acceptors == 1)
+			acceptors[i].listenfd = open_listenfd(port);
+		else
+			acceptors[i].listenfd = open_listenfd_reuseport(port);
+		if (opts.sjf) {
+			/* only accept connections once their request has
+			 * arrived, so that its size can be looked at */
+			int secs = 1;
+			SYS(setsockopt(acceptors[i].listenfd, IPPROTO_TCP,
+				       TCP_DEFER_ACCEPT, &secs, sizeof(secs)));
+		}
+	}
+	/* the main thread is the first acceptor */
+	for (i = 1; i < nr_acceptors; i++) {
+		if (pthread_create(&acceptors[i].thread, NULL, acceptor_loop,
+				   &acceptors[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+	acceptor_loop(&acceptors[0]);
+	for (i = 1; i < nr_acceptors; i++) {
+		pthread_join(acceptors[i].thread, NULL);
 	}
+	free(acceptors);
 
 	close_fifo();
 	server_exit(sv);
+	if (trace_file) {
+		if (!trace_dump(trace_file))
+			perror(trace_file);
+		trace_destroy();
+	}
 
 	/* we don't check for memory leaks using mallinfo() because pthreads
 	 * caches thread state even after a thread exits so that it can reuse
@@ -1,654 +1,1224 @@
+#include <sys/epoll.h>
 #include "request.h"
 #include "server_thread.h"
+#include "cache.h"
+#include "queue.h"
+#include "snapshot.h"
+#include "access_log.h"
+#include "stats.h"
+#include "trace.h"
 #include "common.h"
 
-static void
-file_data_free(struct file_data *data);
-
-// Hash Function for hash table
-// Hash function used is djb2, obtained from
-// http://www.cse.yorku.ca/~oz/hash.html
-unsigned long
-hash(char *str)
-{
-	unsigned long hash = 5381;
-	int c;
-
-	while ((c = *str++))
-		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+struct server {
+	int nr_threads;
+	int max_requests;
+	int max_cache_size;
+	int zero_copy;
+	int idle_timeout;	/* ms to keep an idle connection open */
+	int exiting;
+	enum overload_policy overload;
+	long nr_rejected;	/* connections turned away with a 503 */
+	long nr_dropped;	/* of which had already been queued */
+
+	struct worker *workers;
+	// With an adaptive pool, workers has room for pool->max_threads
+	struct pool *pool;
+	// Accepted connections waiting for a worker. With work stealing,
+	// each worker has its own queue in worker_queues instead.
+	struct queue *requests;
+	struct queue_set *worker_queues;
+	// With shortest-job-first scheduling, the shared queue is ordered by
+	// the size of the requested file instead
+	struct pqueue *sjf_requests;
+
+	// With staged processing, connections move between the stages as
+	// jobs. free_jobs holds the indexes of the jobs that are not in use.
+	struct stage *stages;
+	struct job *jobs;
+	int nr_jobs;
+	struct queue *free_jobs;
+	// Connections waiting for their next request are not held by a
+	// stage thread, but wait in epfd until they are readable. The poller
+	// thread hands readable ones to the parse stage, and closes the ones
+	// that stay idle. wait_lock orders adding a job to epfd with the
+	// poller taking it out.
+	int epfd;
+	pthread_t poller;
+	pthread_mutex_t wait_lock;
 
-	return hash;
-}
+	Cache *cache;
+	int nr_cache_shards;
+	const char *hot_path;	/* where to save the hot files on exit */
+	const char *snapshot_path;	/* where to save the cache on exit */
+	struct snapshot *snapshot;	/* the cache may point into this */
+
+	// Request timings. accept_ns holds when each connection was accepted,
+	// indexed by its descriptor, to time how long it waits for a thread.
+	struct stats *stats;
+	long *accept_ns;
+	int nr_fds;
+
+	// Requests are recorded to access_log for the client to replay
+	const char *record_path;
+	struct access_log *access_log;
+};
 
-typedef struct cache_entry {
+/* a connection, and the request being served on it */
+struct job {
+	struct connection *conn;
+	int fd;			/* of conn */
+	int first;		/* no request has been read on conn yet */
+	long queue_ns;		/* how long conn waited for a thread, or -1 */
+	struct request *rq;
 	struct file_data *data;
-	int in_use;
-	struct cache_entry *next;
-} CacheEntry;
-
-typedef struct lru_ele {
-	CacheEntry *entry;
-	struct lru_ele *next;
-} LRUEntry;
-
-typedef struct lru {
-	LRUEntry *head;
-	LRUEntry *tail;
-	int size;
-
-	//pthread_mutex_t lock_lru;
-} LRUList;
-
-typedef struct cache {
-	CacheEntry *table;
-	LRUList *LRU;
-	
-	long size;
-	long capacity;
-	long max_cache_size;
+	int keep_alive;
+	long start_ns;		/* when the request was read */
+	long idle_ns;		/* when the job started waiting in epfd, or 0
+				 * if it is not waiting, under wait_lock */
+	int stats;		/* the request is for the statistics, and is
+				 * not timed */
+};
 
-	int rc;
-	pthread_cond_t cv_rc;
+enum { WORKER_FREE, WORKER_RUNNING, WORKER_RETIRED };
 
-	pthread_mutex_t lock;
+struct worker {
+	pthread_t thread;
+	struct server *sv;
+	int id;		/* the worker's queue in sv->worker_queues */
+	int state;	/* a retired worker has exited but is not joined yet */
+};
 
-} Cache;
+/* an adaptive pool grows when connections wait for a worker, and shrinks
+ * when workers stay idle */
+struct pool {
+	pthread_t thread;
+	int min_threads;
+	int max_threads;
+	int nr_running;		/* workers started and not yet retired */
+	int nr_idle;		/* workers waiting for a connection */
+	int nr_retire;		/* workers asked to retire */
+	long service_ns;	/* time spent serving connections, and */
+	long nr_served;		/* connections served, since the last tick */
+	double avg_busy;	/* moving averages of the busy workers, */
+	double avg_service;	/* and of the ns spent per connection */
+	int quiet_ticks;	/* ticks in a row with idle workers and no
+				 * backlog */
+};
 
-struct request_buffer {
-	int* requests;
-	int in;
-	int out;
-	int max_size;
+/* the pool is resized at most every POOL_INTERVAL ms. idle workers also
+ * wake up this often to see if they should retire */
+#define POOL_INTERVAL 100
+/* shrink after this many quiet ticks in a row */
+#define POOL_SHRINK_TICKS 20
+/* keep enough workers for them to be busy this fraction of the time */
+#define POOL_TARGET_BUSY 0.75
+/* weight of the latest sample in the moving averages */
+#define POOL_EWMA 0.2
+
+/* how often, in ms, a worker holding an idle connection checks whether it
+ * should give it up, and the poller of the staged mode closes idle
+ * connections */
+#define IDLE_POLL_INTERVAL 50
+/* most connections the poller hands to the parse stage per wakeup */
+#define POLL_BATCH 64
+
+/* with shortest-job-first scheduling, a connection is queued as if it had
+ * arrived as many us later as its request is expected to take, but at most
+ * SJF_MAX_DELAY ms later, so that large files still make progress. a file
+ * takes a us per SJF_BYTES_PER_US bytes to process, and SJF_MISS_COST us
+ * more if it is not cached, which is about the simulated disk read.
+ * requests for missing files are queued by arrival, since they fail fast. */
+#define SJF_BYTES_PER_US 32
+#define SJF_MISS_COST 10000
+#define SJF_MAX_DELAY 100
+
+/* cache warm-up. the hottest files on a list that fit in their shards are
+ * picked first, then threads read them and cache them, coldest first */
+struct warmup {
+	Cache *cache;
+	char **names;		/* the files picked, hottest first */
+	int nr_names;
+	int next;		/* the number of files taken, from the end */
 };
 
-struct server {
+/* with staged processing, a request goes through one stage after another.
+ * each stage has its own pool of threads and its own queue of jobs. */
+enum { STAGE_PARSE, STAGE_IO, STAGE_SEND, NR_STAGES };
+
+static const char *stage_names[NR_STAGES] = { "parse", "io", "send" };
+
+struct stage {
+	pthread_t *threads;
 	int nr_threads;
-	int max_requests;
-	int max_cache_size;
-	int exiting;
+	struct server *sv;
+	struct queue *jobs;	/* indexes into sv->jobs */
+	// Does the stage's part of a job. Returns the stage that takes the
+	// job next, or -1 if the connection is done.
+	int (*run)(struct server *sv, struct job *job);
+	long nr_done;		/* jobs this stage has run */
+	long peak_depth;	/* most jobs seen waiting in the queue */
+};
 
-	pthread_t* threads;
-	struct request_buffer buffer;
+/* at most this many descriptors have their accept time kept, so
+ * connections on higher ones are not timed while they wait */
+#define MAX_TIMED_FDS 65536
 
-	pthread_cond_t cv_full;
-	pthread_cond_t cv_empty;
-	pthread_mutex_t lock;
+/* static functions */
 
-	Cache *cache;
-};
+static long now_ns(void);
+static void server_stats_print(struct server *sv, FILE *f);
 
-//	=================	LRU Functions	=================	//
+/* notes how long the connection of job waited for a thread. it is only
+ * recorded once its first request turns out not to be for the statistics */
+static void
+server_queue_wait(struct server *sv, struct job *job)
+{
+	job->queue_ns = -1;
+	if (job->fd < sv->nr_fds)
+		job->queue_ns = now_ns() - __atomic_load_n(&sv->accept_ns[job->fd],
+							   __ATOMIC_RELAXED);
+}
 
-LRUEntry* find_in_LRU(LRUList *LRU, CacheEntry *target) {
-	//pthread_mutex_lock(&LRU->lock_lru);
-	LRUEntry* current = LRU->head;
-	while (current != NULL) {
-		if (current->entry == target)
-			break;
-		current = current->next;
-	}
-	//pthread_mutex_unlock(&LRU->lock_lru);
-	return current;
+/* makes the server statistics the response to job->rq */
+static void
+server_stats_body(struct server *sv, struct job *job)
+{
+	char *buf;
+	size_t size;
+	FILE *f = open_memstream(&buf, &size);
+
+	assert(f);
+	server_stats_print(sv, f);
+	SYS(fclose(f));
+	request_set_body(job->rq, buf, size);
 }
 
-LRUEntry* find_in_LRU_with_prev(LRUList *LRU, CacheEntry *target, LRUEntry **prev) {
-	//pthread_mutex_lock(&LRU->lock_lru);
-	*prev = NULL;
-	LRUEntry* current = LRU->head;
-	while (current != NULL) {
-		if (current->entry == target)
-			break;
-		*prev = current;
-		current = current->next;
-	}
-	//pthread_mutex_unlock(&LRU->lock_lru);
-	return current;
-}
-
-// Appends given node to queue
-void add_to_LRU(LRUList *LRU, CacheEntry *entry) {
-	//pthread_mutex_lock(&LRU->lock_lru);
-	LRUEntry *node = (LRUEntry *) malloc(sizeof(LRUEntry));
-	assert(node);
-	node->entry = entry;
-	node->next = NULL;
-	if (LRU->head == NULL) {
-		// LRU is currently empty
-		LRU->head = node;
-		LRU->tail = node;
-	} else {
-		LRU->tail->next = node;	// Append to end of queue
-		LRU->tail = LRU->tail->next;	// Move tail to new end of queue
-	}
-	LRU->size++;	// Update queue size
-	//pthread_mutex_unlock(&LRU->lock_lru);
+/* records job->rq in the access log. the first request on a connection
+ * arrived when the connection was accepted, and later ones about when the
+ * thread started reading them, since the thread was waiting for them */
+static void
+server_record(struct server *sv, struct job *job)
+{
+	long ns = job->start_ns;
+
+	if (job->first && job->fd < sv->nr_fds)
+		ns = __atomic_load_n(&sv->accept_ns[job->fd], __ATOMIC_RELAXED);
+	access_log_record(sv->access_log, ns, request_uri(job->rq));
 }
 
-// Moves the head of the queue to the end
-void move_head_to_end(LRUList *LRU) {
-	//pthread_mutex_lock(&LRU->lock_lru);
-	if (LRU->size <= 1) {
-		//pthread_mutex_unlock(&LRU->lock_lru);
-		return;
+/* reads the next request on job->conn, filling job->data->file_name with
+ * the file being requested. returns 0 if there is no request. */
+static int
+server_parse(struct server *sv, struct job *job)
+{
+	job->start_ns = now_ns();
+	job->data = file_data_init();
+	job->rq = request_init(job->conn, job->data);
+	if (!job->rq) {
+		file_data_put(job->data);
+		job->data = NULL;
+		return 0;
 	}
-	LRUEntry *old_head = LRU->head;
-	LRU->head = LRU->head->next;
-	LRU->tail->next = old_head;
-	LRU->tail = old_head;
-	old_head->next = NULL;
-	//pthread_mutex_unlock(&LRU->lock_lru);
+	job->keep_alive = request_keep_alive(job->rq);
+	job->stats = request_stats(job->rq);
+	TRACE(TRACE_DEBUG, TRACE_REQUEST, job->fd, 0, job->data->file_name);
+	if (sv->access_log && !job->stats)
+		server_record(sv, job);
+	if (!job->stats && job->first && job->queue_ns >= 0)
+		stats_record(sv->stats, STATS_QUEUE, job->queue_ns);
+	if (!job->stats)
+		stats_record(sv->stats, STATS_PARSE, now_ns() - job->start_ns);
+	return 1;
 }
 
-void move_node_to_end(LRUList *LRU, CacheEntry *entry) {
-	//pthread_mutex_lock(&LRU->lock_lru);
-	if (LRU->size <= 1)
-		return;
-	LRUEntry *prev;
-	LRUEntry *node = find_in_LRU_with_prev(LRU, entry, &prev);
-	if (!node) {
-		//pthread_mutex_unlock(&LRU->lock_lru);
-		return;
-	}
-	if (node == LRU->head)
-		move_head_to_end(LRU);
-	else if (node != LRU->tail) {
-		prev->next = node->next;
-		node->next = NULL;
-		LRU->tail->next = node;
-		LRU->tail = node;
-	}
-	//pthread_mutex_unlock(&LRU->lock_lru);
-}
-
-// Removes and returns and the head of the queue
-LRUEntry* pop_LRU(LRUList *LRU) {
-	//pthread_mutex_lock(&LRU->lock_lru);
-	LRUEntry* old_head = LRU->head;
-	LRU->head = LRU->head->next;
-	old_head->next = NULL;
-	LRU->size--;	// Update queue size
-	//pthread_mutex_unlock(&LRU->lock_lru);
-	return old_head;
-}
-
-// Removes target node from queue
-void remove_from_LRU(LRUList *LRU, CacheEntry *target) {
-	//pthread_mutex_lock(&LRU->lock_lru);
-	if (LRU->size == 1) {
-		// This is the only node in the queue
-		free(LRU->head);
-		LRU->head = NULL;
-		LRU->tail = NULL;
-		LRU->size = 0;
-		//pthread_mutex_unlock(&LRU->lock_lru);
-		return;
-	}
+/* looks the requested file up in the cache, or reads it. returns 0 if the
+ * file could not be read, in which case the client got an error. */
+static int
+server_fetch(struct server *sv, struct job *job)
+{
+	int ret, cache_inserted = 0;
+	struct request *rq = job->rq;
+	struct file_data *data = job->data;
+	long start;
 
-	LRUEntry *current = LRU->head;
-	LRUEntry *prev = NULL;
-	while (current != NULL) {
-		if (current->entry == target)
-			break;
-		prev = current;
-		current = current->next;
+	if (job->stats) {
+		server_stats_body(sv, job);
+		return 1;
 	}
 
-	if (current) {
-		if (!prev)
-			LRU->head = current->next;
-		else
-			prev->next = current->next;
-		current->next = NULL;
-		if (current == LRU->tail)
-			LRU->tail = prev;
-
-		free(current);
-		LRU->size--;
-	}
-	//pthread_mutex_unlock(&LRU->lock_lru);
-}
-
-LRUEntry* remove_node_from_LRU(LRUList *LRU, LRUEntry *target, LRUEntry *prev) {
-	//pthread_mutex_lock(&LRU->lock_lru);
-	LRUEntry *ret;
-	if (LRU->size == 1) {
-		// This is the only node in the queue
-		LRU->head = NULL;
-		LRU->tail = NULL;
-		ret = NULL;
-	} else if (prev == NULL) {
-		// Removing head
-		LRU->head = LRU->head->next;
-		target->next = NULL;
-		ret = LRU->head;
+	// Check for cache hit. A hit holds its own reference to the cached
+	// data, so it stays valid even if it is evicted while being sent. If
+	// another request is already reading the same file, wait for it and
+	// share its data rather than reading the file again. The wait counts
+	// as disk time rather than lookup time.
+	struct file_data *cached = NULL;
+	CacheFlight *flight = NULL;
+	int waited = 0;
+	if (sv->cache) {
+		start = now_ns();
+		cached = cache_lookup(sv->cache, data->file_name);
+		stats_record(sv->stats, STATS_LOOKUP, now_ns() - start);
+		if (cached == NULL) {
+			start = now_ns();
+			cached = cache_fetch(sv->cache, data->file_name,
+					     &flight, &waited);
+			if (waited)
+				stats_record(sv->stats, STATS_DISK,
+					     now_ns() - start);
+		}
+		stats_add(sv->stats, cached && waited ? STATS_COALESCED :
+			  cached ? STATS_HITS : STATS_MISSES, 1);
+	}
+	if (cached != NULL) {
+		TRACE(TRACE_DEBUG, TRACE_HIT, cached->file_size, 0,
+		      cached->file_name);
+		file_data_put(data);
+		job->data = cached;
+		request_set_data(rq, cached);
 	} else {
-		prev->next = target->next;
-		target->next = NULL;
-		if (target == LRU->tail) {
-			// Update new tail
-			LRU->tail = prev;
+		/* read file, 
+		* fills data->file_buf with the file contents,
+		* data->file_size with file size and data->header with the
+		* response header. In zero-copy mode, files that the cache
+		* cannot hold are streamed instead of read into memory. */
+		long max_buffered = -1;
+		TRACE(TRACE_DEBUG, TRACE_MISS, 0, 0, data->file_name);
+		if (sv->zero_copy)
+			max_buffered = sv->cache ? cache_max_file_size(sv->cache) : 0;
+		start = now_ns();
+		ret = request_readfile(rq, max_buffered);
+		stats_record(sv->stats, STATS_DISK, now_ns() - start);
+		if (flight) {
+			// Add file to cache, and hand it to any waiting requests.
+			// Waiters on a streamed file stream it themselves.
+			cache_inserted = cache_fetch_done(sv->cache, flight,
+							  (ret && !request_streamed(rq)) ? data : NULL);
+			TRACE(TRACE_DEBUG, TRACE_INSERT, cache_inserted,
+			      data->file_size, data->file_name);
+		}
+		if (ret == 0) { /* couldn't read file */
+			job->keep_alive = 0;
+			return 0;
 		}
-		ret = prev->next;
 	}
-	free(target);
-	LRU->size--;	// Update queue size
-	//pthread_mutex_unlock(&LRU->lock_lru);
-	return ret;
-} 
+	return 1;
+}
 
-// Frees all nodes in the given queue
-void clear_LRU(LRUList *LRU) {
-	if (LRU == NULL)
-		return;
-	//pthread_mutex_lock(&LRU->lock_lru);
-	while (LRU->head != NULL) {
-		LRUEntry *next = LRU->head->next;
-		free(LRU->head);
-		LRU->head = next;
+/* sends the file to the client if send is set, and finishes the request.
+ * returns 1 if the connection should be kept open for another request. */
+static int
+server_finish(struct server *sv, struct job *job, int send)
+{
+	long start, sent;
+
+	if (send && job->stats) {
+		if (!request_sendfile(job->rq))
+			job->keep_alive = 0;
+	} else if (send) {
+		start = now_ns();
+		request_processfile(job->rq);
+		sent = now_ns();
+		stats_record(sv->stats, STATS_PROCESS, sent - start);
+		if (request_sendfile(job->rq)) {
+			stats_record(sv->stats, STATS_SEND, now_ns() - sent);
+			stats_add(sv->stats, STATS_BYTES, job->data->header_size +
+				  job->data->file_size);
+		} else {
+			/* the client went away, only this connection fails */
+			job->keep_alive = 0;
+		}
 	}
-	LRU->tail = NULL;
-	LRU->size = 0;
-	//pthread_mutex_unlock(&LRU->lock_lru);
+	if (!job->stats) {
+		stats_record(sv->stats, STATS_TOTAL, now_ns() - job->start_ns);
+		stats_add(sv->stats, STATS_REQUESTS, 1);
+	}
+	request_destroy(job->rq);
+	file_data_put(job->data);
+	job->rq = NULL;
+	job->data = NULL;
+	return job->keep_alive;
+}
+
+/* serves the next request on job->conn. returns 1 if the connection should
+ * be kept open for another request. */
+static int
+do_server_one(struct server *sv, struct job *job)
+{
+	if (!server_parse(sv, job))
+		return 0;
+	return server_finish(sv, job, server_fetch(sv, job));
 }
 
-void destroy_LRU(LRUList *LRU) {
-	clear_LRU(LRU);
-	//pthread_mutex_destroy(&LRU->lock_lru);
-	free(LRU);
+/* returns 1 if connections are waiting for a worker */
+static int
+server_backlog(struct server *sv)
+{
+	if (sv->sjf_requests)
+		return !pqueue_empty(sv->sjf_requests);
+	if (sv->worker_queues)
+		return !queue_set_empty(sv->worker_queues);
+	if (sv->requests == NULL)
+		return 1;	/* the connection is being served by the acceptor */
+	return !queue_empty(sv->requests);
 }
 
-//	=================	End of LRU Functions		=================	//
+/* waits for the next request on a connection. pipelined requests are
+ * served right away. otherwise the worker waits for up to the idle timeout.
+ * after the first request, it gives the connection up early when the server
+ * is exiting or other connections are waiting for a worker. returns 1 if
+ * there is a request to serve. */
+static int
+server_wait_request(struct server *sv, struct connection *conn, int first)
+{
+	int waited = 0, ret;
+
+	if (first && sv->idle_timeout == 0)
+		return 1;	/* keep-alive is off, so wait for the request */
+	while ((ret = connection_wait(conn, 0)) == 0) {
+		if (waited >= sv->idle_timeout ||
+		    __atomic_load_n(&sv->exiting, __ATOMIC_RELAXED) ||
+		    (!first && server_backlog(sv)))
+			return 0;
+		ret = connection_wait(conn, IDLE_POLL_INTERVAL);
+		if (ret != 0)
+			break;
+		waited += IDLE_POLL_INTERVAL;
+	}
+	return ret > 0;
+}
 
+/* serves requests on connfd until the client closes the connection, asks
+ * for it to be closed, or leaves it idle */
+static void
+do_server_request(struct server *sv, int connfd)
+{
+	struct job job;
+
+	job.conn = connection_init(connfd);
+	job.fd = connfd;
+	job.first = 1;
+	server_queue_wait(sv, &job);
+	while (server_wait_request(sv, job.conn, job.first) &&
+	       do_server_one(sv, &job))
+		job.first = 0;
+	connection_destroy(job.conn);
+}
 
-// ======================== Hashtable Operations ========================
+/* the parse stage reads the next request on a connection that is
+ * readable */
+static int
+stage_parse(struct server *sv, struct job *job)
+{
+	if (job->first)
+		server_queue_wait(sv, job);
+	if (!server_parse(sv, job))
+		return -1;
+	return STAGE_IO;
+}
 
-CacheEntry* cache_lookup(Cache *cache, char *filename) {
-	pthread_mutex_lock(&cache->lock);
-	unsigned long key = hash(filename) % cache->capacity;
-	CacheEntry *entry = &cache->table[key];
-	int hit = 0;
-	while (entry->next != NULL) {
-		entry = entry->next;
-		if (!strcmp(entry->data->file_name, filename)) {
-			hit = 1;
-			break;
-		}
+/* the io stage finds the file in the cache or reads it from disk */
+static int
+stage_io(struct server *sv, struct job *job)
+{
+	if (!server_fetch(sv, job)) {
+		server_finish(sv, job, 0);
+		return -1;
 	}
+	return STAGE_SEND;
+}
 
-	CacheEntry *ret;
-	if (hit) {
-		ret = entry;
-		entry->in_use++;
-		printf("%lu is being used. Use count: %d\n", (unsigned long) entry, entry->in_use);
-		move_node_to_end(cache->LRU, entry);
-	} else ret = NULL;
+/* the send stage processes the file and sends it. a kept-alive connection
+ * goes back to the parse stage once its next request arrives */
+static int
+stage_send(struct server *sv, struct job *job)
+{
+	if (!server_finish(sv, job, 1))
+		return -1;
+	job->first = 0;
+	return STAGE_PARSE;
+}
 
-	pthread_mutex_unlock(&cache->lock);
-	return ret;
+/* hands job i to stage st */
+static void
+stage_push(struct stage *st, int i)
+{
+	long depth, peak;
+
+	// Every queue can hold all the jobs, so this never waits
+	queue_push(st->jobs, i);
+	depth = queue_length(st->jobs);
+	peak = __atomic_load_n(&st->peak_depth, __ATOMIC_RELAXED);
+	while (depth > peak &&
+	       !__atomic_compare_exchange_n(&st->peak_depth, &peak, depth, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-int cache_exists(Cache *cache, char *filename) {
-	unsigned long key = hash(filename) % cache->capacity;
-	CacheEntry *entry = &cache->table[key];
-	while (entry->next != NULL) {
-		entry = entry->next;
-		if (!strcmp(entry->data->file_name, filename)) {
-			return 1;
-		}
+/* closes the connection of job i and frees the job */
+static void
+stage_done(struct server *sv, int i)
+{
+	connection_destroy(sv->jobs[i].conn);
+	sv->jobs[i].conn = NULL;
+	queue_push(sv->free_jobs, i);
+}
+
+/* hands job i to the parse stage once its connection is readable. a
+ * pipelined request is already buffered and goes straight there. without
+ * keep-alive, only pipelined requests are served after the first one. */
+static void
+stage_wait(struct server *sv, int i)
+{
+	struct job *job = &sv->jobs[i];
+	struct epoll_event ev;
+
+	if (connection_wait(job->conn, 0) != 0) {
+		stage_push(&sv->stages[STAGE_PARSE], i);
+		return;
+	}
+	if (!job->first && sv->idle_timeout == 0) {
+		stage_done(sv, i);
+		return;
 	}
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.u32 = i;
+	pthread_mutex_lock(&sv->wait_lock);
+	job->idle_ns = now_ns();
+	SYS(epoll_ctl(sv->epfd, EPOLL_CTL_ADD, job->fd, &ev));
+	pthread_mutex_unlock(&sv->wait_lock);
+}
 
-	return 0;
+/* takes waiting job i out of epfd. called with wait_lock held */
+static void
+stage_unwait(struct server *sv, int i)
+{
+	SYS(epoll_ctl(sv->epfd, EPOLL_CTL_DEL, sv->jobs[i].fd, NULL));
+	sv->jobs[i].idle_ns = 0;
 }
 
-void remove_from_cache(Cache *cache, CacheEntry *target) {
-	unsigned long key = hash(target->data->file_name) % cache->capacity;
-	CacheEntry *entry = &cache->table[key];
-	CacheEntry *prev = NULL;
-	int hit = 0;
-	while (entry->next != NULL) {
-		prev = entry;
-		entry = entry->next;
-		if (entry == target) {
-			hit = 1;
-			break;
+/* hands readable connections to the parse stage, and closes connections
+ * that have been idle for longer than the idle timeout. a connection's
+ * first request is waited for as long as it takes when keep-alive is off,
+ * as the workers do. once the server is exiting, the connections left
+ * waiting are closed by stages_exit. */
+static void *
+stages_poll(void *arg)
+{
+	struct server *sv = arg;
+	struct epoll_event events[POLL_BATCH];
+	long timeout = sv->idle_timeout * 1000000L;
+	int i, k, n;
+
+	while (!__atomic_load_n(&sv->exiting, __ATOMIC_RELAXED)) {
+		n = epoll_wait(sv->epfd, events, POLL_BATCH,
+			       IDLE_POLL_INTERVAL);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		pthread_mutex_lock(&sv->wait_lock);
+		for (k = 0; k < n; k++) {
+			i = events[k].data.u32;
+			stage_unwait(sv, i);
+			stage_push(&sv->stages[STAGE_PARSE], i);
+		}
+		for (i = 0; i < sv->nr_jobs; i++) {
+			struct job *job = &sv->jobs[i];
+
+			if (job->idle_ns == 0 ||
+			    (job->first && sv->idle_timeout == 0) ||
+			    now_ns() - job->idle_ns < timeout)
+				continue;
+			stage_unwait(sv, i);
+			stage_done(sv, i);
 		}
+		pthread_mutex_unlock(&sv->wait_lock);
 	}
+	return NULL;
+}
 
-	if (hit) {
-		prev->next = target->next;
-		target->next = NULL;
-		cache->size -= target->data->file_size;
-		//file_data_free(target->data);
-		free(target);
+static void *
+stage_thread(void *arg)
+{
+	struct stage *st = arg;
+	struct server *sv = st->sv;
+	int i, next;
+
+	// queue_pop returns -1 once the server is exiting
+	while ((i = queue_pop(st->jobs)) >= 0) {
+		struct job *job = &sv->jobs[i];
+
+		next = st->run(sv, job);
+		__atomic_add_fetch(&st->nr_done, 1, __ATOMIC_RELAXED);
+		if (next == STAGE_PARSE)
+			stage_wait(sv, i);
+		else if (next >= 0)
+			stage_push(&sv->stages[next], i);
+		else
+			stage_done(sv, i);
 	}
+	return NULL;
 }
 
-unsigned long cache_evict(Cache *cache, unsigned long amount_to_evict) {
-	//return 0;
-	// No need for mutex as this function only called from cache_insert, which already has mutex
-	unsigned long evicted_amount = 0;
-	LRUEntry *current = cache->LRU->head;
-	LRUEntry *prev = NULL;
-	while (current != NULL) {
-		printf("Use count for %lu: %d\n", (unsigned long) current->entry, current->entry->in_use);
-		if (current->entry->in_use > 0) {
-			prev = current;
-			current = current->next;
-		} else {
-			CacheEntry *to_destroy = current->entry;
-			evicted_amount += current->entry->data->file_size;
-			current = remove_node_from_LRU(cache->LRU, current, prev);
-			remove_from_cache(cache, to_destroy);
-			if (evicted_amount >= amount_to_evict)
-				break;
+/* starts the stage thread pools. a connection holds a job until it is
+ * closed, so there are max_requests jobs on top of one per thread. every
+ * stage queue can hold all of them, so a stage never waits for the next
+ * one, and the acceptor waits for a free job instead. */
+static void
+stages_init(struct server *sv, const int *stage_threads)
+{
+	int i, s, t;
+
+	sv->nr_jobs = sv->max_requests;
+	for (s = 0; s < NR_STAGES; s++) {
+		sv->nr_jobs += stage_threads[s];
+	}
+	sv->jobs = Malloc(sv->nr_jobs * sizeof(struct job));
+	sv->free_jobs = queue_init(sv->nr_jobs);
+	for (i = 0; i < sv->nr_jobs; i++) {
+		sv->jobs[i].conn = NULL;
+		sv->jobs[i].rq = NULL;
+		sv->jobs[i].data = NULL;
+		sv->jobs[i].idle_ns = 0;
+		queue_push(sv->free_jobs, i);
+	}
+	SYS(sv->epfd = epoll_create1(EPOLL_CLOEXEC));
+	pthread_mutex_init(&sv->wait_lock, NULL);
+
+	sv->stages = Malloc(NR_STAGES * sizeof(struct stage));
+	sv->stages[STAGE_PARSE].run = stage_parse;
+	sv->stages[STAGE_IO].run = stage_io;
+	sv->stages[STAGE_SEND].run = stage_send;
+	for (s = 0; s < NR_STAGES; s++) {
+		struct stage *st = &sv->stages[s];
+
+		st->sv = sv;
+		st->nr_threads = stage_threads[s];
+		st->jobs = queue_init(sv->nr_jobs);
+		st->nr_done = 0;
+		st->peak_depth = 0;
+	}
+	// Start the threads only once every queue is ready
+	for (s = 0; s < NR_STAGES; s++) {
+		struct stage *st = &sv->stages[s];
+
+		st->threads = Malloc(st->nr_threads * sizeof(pthread_t));
+		for (t = 0; t < st->nr_threads; t++) {
+			if (pthread_create(&st->threads[t], NULL, stage_thread,
+					   st)) {
+				fprintf(stderr, "Error creating %s thread #%d\n",
+					stage_names[s], t);
+				exit(1);
+			}
 		}
 	}
-	return evicted_amount;
+	if (pthread_create(&sv->poller, NULL, stages_poll, sv)) {
+		fprintf(stderr, "Error creating the poller thread\n");
+		exit(1);
+	}
 }
 
-int cache_insert(Cache *cache, struct file_data *file) {
-	pthread_mutex_lock(&cache->lock);
-
-	if (cache_exists(cache, file->file_name)) {
-		pthread_mutex_unlock(&cache->lock);
-		return 0;
-	}
+/* stops the stage threads, closes the connections they left behind and
+ * prints how busy each stage was */
+static void
+stages_exit(struct server *sv)
+{
+	int i, s, t;
 
-	if (file->file_size > cache->max_cache_size) {
-		// File too large. Cannot cache.
-		pthread_mutex_unlock(&cache->lock);
-		return 0;
+	// The poller stops handing jobs to the parse stage first
+	pthread_join(sv->poller, NULL);
+	for (s = 0; s < NR_STAGES; s++) {
+		queue_close(sv->stages[s].jobs);
 	}
-
-	if (cache->size + file->file_size > cache->max_cache_size) {
-		cache_evict(cache, file->file_size - (cache->max_cache_size - cache->size));
-		if (cache->size + file->file_size > cache->max_cache_size) {
-			// Couldn't evict enough
-			pthread_mutex_unlock(&cache->lock);
-			return 0;
+	// A stage thread may still hand a job to another stage, so wait for
+	// all of them before freeing any queue
+	for (s = 0; s < NR_STAGES; s++) {
+		for (t = 0; t < sv->stages[s].nr_threads; t++) {
+			pthread_join(sv->stages[s].threads[t], NULL);
 		}
 	}
-	
-	//pthread_mutex_unlock(&cache->lock);
-	//return 0;	
-	
-	unsigned long key = hash(file->file_name) % cache->capacity;
-	CacheEntry *entry = &cache->table[key];
-	while (entry->next != NULL) {
-		entry = entry->next;
+	for (s = 0; s < NR_STAGES; s++) {
+		struct stage *st = &sv->stages[s];
+
+		printf("stage %s: %d threads, %ld jobs, peak queue depth %ld\n",
+		       stage_names[s], st->nr_threads, st->nr_done,
+		       st->peak_depth);
+		queue_destroy(st->jobs);
+		free(st->threads);
 	}
+	for (i = 0; i < sv->nr_jobs; i++) {
+		struct job *job = &sv->jobs[i];
 
-	//pthread_mutex_unlock(&cache->lock);
-	//return 0;
+		if (job->rq)
+			server_finish(sv, job, 0);
+		if (job->conn)
+			connection_destroy(job->conn);
+	}
+	queue_destroy(sv->free_jobs);
+	SYS(close(sv->epfd));
+	pthread_mutex_destroy(&sv->wait_lock);
+	free(sv->stages);
+	free(sv->jobs);
+	sv->stages = NULL;
+}
 
-	entry->next = (CacheEntry *) malloc(sizeof(CacheEntry));
-	assert(entry->next);
-	entry = entry->next;
-	entry->data = file;
-	entry->in_use = 0;
-	entry->next = NULL;
-	cache->size += file->file_size;
+static long
+now_ns(void)
+{
+	struct timespec ts;
 
-	add_to_LRU(cache->LRU, entry);
-	pthread_mutex_unlock(&cache->lock);
-	return 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
-void cache_clear(Cache *cache) {
-	for (int i=0; i<cache->capacity; ++i) {
-		CacheEntry *entry = &cache->table[i];
-		entry = entry->next;
-		while (entry != NULL) {
-			CacheEntry *temp = entry->next;
-			file_data_free(entry->data);
-			free(entry);
-			entry = temp;
+/* returns 1 if the calling worker should retire */
+static int
+pool_retire(struct pool *pool)
+{
+	int n = __atomic_load_n(&pool->nr_retire, __ATOMIC_RELAXED);
+
+	while (n > 0) {
+		if (__atomic_compare_exchange_n(&pool->nr_retire, &n, n - 1, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			__atomic_sub_fetch(&pool->nr_running, 1,
+					   __ATOMIC_RELAXED);
+			return 1;
 		}
 	}
+	return 0;
 }
 
-void cache_destroy(Cache *cache) {
-	if (cache == NULL)
-		return;
-	pthread_mutex_lock(&cache->lock);
-	cache_clear(cache);
-	free(cache->table);
-
-	destroy_LRU(cache->LRU);
-
-	//pthread_mutex_destroy(&cache->lock_entry);
-	//pthread_mutex_destroy(&cache->lock_exit);
-	//pthread_mutex_destroy(&cache->lock_data);
-	//pthread_cond_destroy(&cache->cv_rc);
-
-	free(cache);
-	pthread_mutex_unlock(&cache->lock);
+/* returns the next connection for worker w, -1 once the server is exiting,
+ * or QUEUE_TIMEDOUT if an adaptive pool worker has waited POOL_INTERVAL ms */
+static int
+take_request(struct worker *w)
+{
+	struct server *sv = w->sv;
+	int connfd;
+
+	if (sv->worker_queues)
+		return queue_set_pop(sv->worker_queues, w->id);
+	if (sv->sjf_requests)
+		return pqueue_pop(sv->sjf_requests);
+	if (!sv->pool)
+		return queue_pop(sv->requests);
+	__atomic_add_fetch(&sv->pool->nr_idle, 1, __ATOMIC_RELAXED);
+	connfd = queue_pop_timeout(sv->requests, POOL_INTERVAL);
+	__atomic_sub_fetch(&sv->pool->nr_idle, 1, __ATOMIC_RELAXED);
+	return connfd;
 }
 
-// ======================== End of Hashtable Operations ========================
-
-/* static functions */
-
-/* initialize file data */
-static struct file_data *
-file_data_init(void)
+static void *
+warmup_thread(void *arg)
 {
+	struct warmup *wu = arg;
+	long max_size = cache_max_file_size(wu->cache);
 	struct file_data *data;
-
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
-	data->file_buf = NULL;
-	data->file_size = 0;
-	return data;
+	int i;
+
+	// The eviction policies evict the files inserted first first, so
+	// the hottest files go in last
+	while ((i = __atomic_fetch_add(&wu->next, 1, __ATOMIC_RELAXED)) <
+	       wu->nr_names) {
+		data = file_data_load(wu->names[wu->nr_names - 1 - i],
+				      max_size);
+		if (data == NULL)
+			continue;
+		cache_insert(wu->cache, data);
+		file_data_put(data);
+	}
+	return NULL;
 }
 
-/* free all file data */
+/* fills the cache with the files named in path, listed hottest first,
+ * using nr_threads threads. path is either a fileset index, whose first
+ * line is the number of files, or a list of file names such as cache_save
+ * writes. only the first word of each line is used. a file is only picked
+ * if it fits in what is left of its shard, so that warm-up never evicts
+ * the hotter files it cached before. */
 static void
-file_data_free(struct file_data *data)
+server_warmup(struct server *sv, const char *path, int nr_threads)
 {
-	free(data->file_name);
-	free(data->file_buf);
-	free(data);
+	struct warmup wu;
+	pthread_t *threads;
+	char buf[MAXLINE], name[MAXLINE], file_name[MAXLINE];
+	long max_size = cache_max_file_size(sv->cache);
+	long *room = Malloc(sv->nr_cache_shards * sizeof(long));
+	long start, bytes_loaded = 0;
+	struct stat sbuf;
+	FILE *f;
+	int i, s, max_names = 0, nr_listed = 0, nr_loaded = 0;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	wu.cache = sv->cache;
+	wu.names = NULL;
+	wu.nr_names = 0;
+	wu.next = 0;
+	for (s = 0; s < sv->nr_cache_shards; s++) {
+		room[s] = max_size;
+	}
+	for (i = 0; fgets(buf, MAXLINE, f) != NULL; i++) {
+		if (sscanf(buf, "%s", name) != 1)
+			continue;
+		if (i == 0 && strspn(name, "0123456789") == strlen(name))
+			continue;	/* the count line of a fileset index */
+		nr_listed++;
+		request_file_name(name, file_name, MAXLINE);
+		if (stat(file_name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode))
+			continue;
+		s = cache_shard_index(sv->cache, file_name);
+		if (sbuf.st_size > room[s])
+			continue;	/* a colder, smaller file may still fit */
+		room[s] -= sbuf.st_size;
+		if (wu.nr_names == max_names) {
+			max_names = max_names ? max_names * 2 : 64;
+			wu.names = realloc(wu.names, max_names * sizeof(char *));
+			assert(wu.names);
+		}
+		wu.names[wu.nr_names] = strdup(name);
+		assert(wu.names[wu.nr_names]);
+		wu.nr_names++;
+	}
+	fclose(f);
+
+	start = now_ns();
+	threads = Malloc(nr_threads * sizeof(pthread_t));
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, warmup_thread, &wu)) {
+			fprintf(stderr, "Error creating warm-up thread #%d\n",
+				i);
+			exit(1);
+		}
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	// Count the files that are still cached, in case a file changed size
+	// since it was picked
+	for (i = 0; i < wu.nr_names; i++) {
+		request_file_name(wu.names[i], file_name, MAXLINE);
+		if (cache_contains(sv->cache, file_name) &&
+		    stat(file_name, &sbuf) == 0) {
+			nr_loaded++;
+			bytes_loaded += sbuf.st_size;
+		}
+		free(wu.names[i]);
+	}
+	printf("warm-up: cached %d of %d files, %ld bytes, in %.3f s\n",
+	       nr_loaded, nr_listed, bytes_loaded, (now_ns() - start) / 1e9);
+	fflush(stdout);
+	free(wu.names);
+	free(threads);
+	free(room);
 }
 
+/* fills the cache from the snapshot saved by the last run, if any. a
+ * snapshot that matches no files is dropped. */
 static void
-do_server_request(struct server *sv, int connfd)
+server_snapshot_load(struct server *sv)
 {
-	int ret, cache_inserted = 0;
-	struct request *rq;
-	struct file_data *data;
-
-	data = file_data_init();
+	int nr_cached, nr_entries;
+	long start = now_ns();
 
-	/* fill data->file_name with name of the file being requested */
-	rq = request_init(connfd, data);
-	if (!rq) {
-		file_data_free(data);
+	sv->snapshot = snapshot_load(sv->cache, sv->snapshot_path,
+				     &nr_cached, &nr_entries);
+	if (!sv->snapshot)
 		return;
+	printf("snapshot: cached %d of %d files in %.3f s\n", nr_cached,
+	       nr_entries, (now_ns() - start) / 1e9);
+	fflush(stdout);
+	if (nr_cached == 0) {
+		snapshot_destroy(sv->snapshot);
+		sv->snapshot = NULL;
 	}
+}
 
-	// Check for cache hit
-	CacheEntry *cache_value = NULL;
-	if (sv->cache)
-		cache_value = cache_lookup(sv->cache, data->file_name);
-	if (cache_value != NULL) {
-		//pthread_mutex_lock(&sv->cache->lock);
-		//cache_value->in_use++;
-		//printf("%lu is being used. Use count: %d\n", (unsigned long) cache_value, cache_value->in_use);
-		//pthread_mutex_unlock(&sv->cache->lock);
-		file_data_free(data);
-		request_set_data(rq, cache_value->data);
-	} else {
-		/* read file, 
-		* fills data->file_buf with the file contents,
-		* data->file_size with file size. */
-		ret = request_readfile(rq);
-		if (ret == 0) { /* couldn't read file */
-			goto out;
-		} else {
-			// Add file to cache
-			//pthread_mutex_lock(&sv->cache->lock);
-			printf("About to add file to cache\n");
-			if (sv->cache)
-				cache_inserted = cache_insert(sv->cache, data);
-			printf("Cache inserted: %d\n", cache_inserted);
-			//pthread_mutex_unlock(&sv->cache->lock);
+/* entry point functions */
+
+void worker_thread(struct worker* w) {
+	struct server *sv = w->sv;
+	struct pool *pool = sv->pool;
+	int connfd;
+	long start;
+
+	while ((connfd = take_request(w)) != -1) {
+		if (connfd >= 0 && !pool) {
+			do_server_request(sv, connfd);
+		} else if (connfd >= 0) {
+			start = now_ns();
+			do_server_request(sv, connfd);
+			__atomic_add_fetch(&pool->service_ns, now_ns() - start,
+					   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&pool->nr_served, 1,
+					   __ATOMIC_RELAXED);
+		}
+		if (pool && pool_retire(pool)) {
+			__atomic_store_n(&w->state, WORKER_RETIRED,
+					 __ATOMIC_RELEASE);
+			break;
 		}
 	}
+	pthread_exit((void*)0);
+}
 
-	
-	/* send file to client */
-	request_sendfile(rq);
-	if (cache_value) {
-		pthread_mutex_lock(&sv->cache->lock);
-		cache_value->in_use--;
-		printf("%lu no longer being used. Use count: %d\n", (unsigned long) cache_value, cache_value->in_use);
-		assert(cache_value->in_use >= 0);
-		pthread_mutex_unlock(&sv->cache->lock);
+/* starts worker i */
+static void
+worker_start(struct server *sv, int i)
+{
+	sv->workers[i].sv = sv;
+	sv->workers[i].id = i;
+	sv->workers[i].state = WORKER_RUNNING;
+	if (pthread_create(&sv->workers[i].thread, NULL, (void * (*)(void *)) worker_thread, &sv->workers[i])) {
+		fprintf(stderr, "Error creating thread #%d\n", i);
+		exit(1);
 	}
-out:
-	request_destroy(rq);
-	//if (!cache_inserted)
-	//	file_data_free(data);
 }
 
-/* entry point functions */
-
-void add_request(struct server* sv, int connfd) {
-	// Acquire lock for mutual exclusion
-	pthread_mutex_lock(&sv->lock);
-
-	while ((sv->buffer.in - sv->buffer.out + sv->buffer.max_size) % sv->buffer.max_size == sv->buffer.max_size - 1) {
-		// Buffer is full. Wait for buffer space to be free
-		pthread_cond_wait(&sv->cv_full, &sv->lock);
+/* starts nr more workers in free slots. retired workers are joined first,
+ * so that their slots can be reused */
+static void
+pool_grow(struct server *sv, int nr)
+{
+	struct pool *pool = sv->pool;
+	int i;
+
+	for (i = 0; i < pool->max_threads; i++) {
+		if (__atomic_load_n(&sv->workers[i].state, __ATOMIC_ACQUIRE) ==
+		    WORKER_RETIRED) {
+			pthread_join(sv->workers[i].thread, NULL);
+			sv->workers[i].state = WORKER_FREE;
+		}
 	}
-
-	// Add socket info for request in buffer
-	sv->buffer.requests[sv->buffer.in] = connfd;
-
-	if (sv->buffer.in == sv->buffer.out) {
-		// Buffer was empty but now has requests. Wake up sleeping worker threads
-		pthread_cond_broadcast(&sv->cv_empty);
+	for (i = 0; i < pool->max_threads && nr > 0; i++) {
+		if (__atomic_load_n(&sv->workers[i].state, __ATOMIC_RELAXED) ==
+		    WORKER_FREE) {
+			__atomic_add_fetch(&pool->nr_running, 1,
+					   __ATOMIC_RELAXED);
+			worker_start(sv, i);
+			nr--;
+		}
 	}
-
-	// Update in
-	sv->buffer.in = (sv->buffer.in + 1) % sv->buffer.max_size;
-
-	// Release lock
-	pthread_mutex_unlock(&sv->lock);
 }
 
-void take_request(struct server* sv) {
-	// Acquire lock for mutual exclusion
-	pthread_mutex_lock(&sv->lock);
-	while (!sv->exiting && sv->buffer.in == sv->buffer.out) {
-		// Buffer is empty. Wait for buffer to have requests
-		pthread_cond_wait(&sv->cv_empty, &sv->lock);
+/* resizes the pool based on what the workers did since the last tick */
+static void
+pool_adjust(struct server *sv)
+{
+	struct pool *pool = sv->pool;
+	long backlog = queue_length(sv->requests);
+	int idle = __atomic_load_n(&pool->nr_idle, __ATOMIC_RELAXED);
+	int retiring = __atomic_load_n(&pool->nr_retire, __ATOMIC_RELAXED);
+	int running = __atomic_load_n(&pool->nr_running, __ATOMIC_RELAXED);
+	long served = __atomic_exchange_n(&pool->nr_served, 0, __ATOMIC_RELAXED);
+	long ns = __atomic_exchange_n(&pool->service_ns, 0, __ATOMIC_RELAXED);
+	int busy = running > idle ? running - idle : 0;
+	int size = running - retiring;	/* the size the pool is heading to */
+	int nr;
+
+	pool->avg_busy = POOL_EWMA * busy + (1 - POOL_EWMA) * pool->avg_busy;
+	if (served > 0) {
+		pool->avg_service = POOL_EWMA * ns / served +
+			(1 - POOL_EWMA) * pool->avg_service;
 	}
 
-	// Take request from buffer
-	int connfd = sv->buffer.requests[sv->buffer.out];
-
-	if ((sv->buffer.in - sv->buffer.out + sv->buffer.max_size) % sv->buffer.max_size == sv->buffer.max_size - 1) {
-		// Buffer was full but is no longer full. Wake up threads sleeping on full
-		pthread_cond_broadcast(&sv->cv_full);
+	if (backlog > 0 && idle == 0) {
+		// Connections are waiting and no worker is free. Add enough
+		// workers to drain the backlog within a tick at the average
+		// service time, but at most double the pool at a time.
+		pool->quiet_ticks = 0;
+		nr = 1 + backlog * pool->avg_service / (POOL_INTERVAL * 1e6);
+		if (nr > size)
+			nr = size;
+		if (nr > pool->max_threads - size)
+			nr = pool->max_threads - size;
+		if (nr <= 0)
+			return;
+		// Workers asked to retire are the cheapest ones to get back
+		while (retiring > 0 && nr > 0) {
+			if (__atomic_compare_exchange_n(&pool->nr_retire,
+							&retiring, retiring - 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED)) {
+				retiring--;
+				nr--;
+				size++;
+			}
+		}
+		pool_grow(sv, nr);
+		printf("pool: %d threads\n", size + nr);
+	} else if (backlog == 0 && idle > 0) {
+		if (++pool->quiet_ticks < POOL_SHRINK_TICKS)
+			return;
+		// Workers have been idle for a while. Retire half of the
+		// workers beyond what the average load needs.
+		pool->quiet_ticks = 0;
+		nr = (int)(pool->avg_busy / POOL_TARGET_BUSY) + 1;
+		if (nr < pool->min_threads)
+			nr = pool->min_threads;
+		nr = (size - nr + 1) / 2;
+		if (nr <= 0)
+			return;
+		__atomic_add_fetch(&pool->nr_retire, nr, __ATOMIC_RELAXED);
+		printf("pool: %d threads\n", size - nr);
+	} else {
+		pool->quiet_ticks = 0;
 	}
+}
 
-	// Update out
-	sv->buffer.out = (sv->buffer.out + 1) % sv->buffer.max_size;
-
-	// Release lock
-	pthread_mutex_unlock(&sv->lock);
+static void *
+pool_thread(void *arg)
+{
+	struct server *sv = arg;
 
-	// Perform request
-	if (!sv->exiting)
-		do_server_request(sv, connfd);
+	while (!__atomic_load_n(&sv->exiting, __ATOMIC_RELAXED)) {
+		usleep(POOL_INTERVAL * 1000);
+		pool_adjust(sv);
+	}
+	return NULL;
 }
 
-void worker_thread(struct server* sv) {
-	while (!sv->exiting) {
-		take_request(sv);
+/* starts nr_threads workers, and a pool thread that keeps the number of
+ * workers between min_threads and max_threads */
+static void
+pool_init(struct server *sv, int min_threads, int max_threads)
+{
+	struct pool *pool = Malloc(sizeof(struct pool));
+	int i;
+
+	pool->min_threads = min_threads;
+	pool->max_threads = max_threads;
+	pool->nr_running = 0;
+	pool->nr_idle = 0;
+	pool->nr_retire = 0;
+	pool->service_ns = 0;
+	pool->nr_served = 0;
+	pool->avg_busy = 0;
+	pool->avg_service = 0;
+	pool->quiet_ticks = 0;
+	sv->pool = pool;
+	sv->workers = Malloc(max_threads * sizeof(struct worker));
+	for (i = 0; i < max_threads; i++) {
+		sv->workers[i].state = WORKER_FREE;
+	}
+	pool_grow(sv, sv->nr_threads);
+	if (pthread_create(&pool->thread, NULL, pool_thread, sv)) {
+		fprintf(stderr, "Error creating pool thread\n");
+		exit(1);
 	}
-	pthread_exit((void*)0);
 }
 
 struct server *
-server_init(int nr_threads, int max_requests, int max_cache_size)
+server_init(const struct server_options *opts)
 {
 	struct server *sv;
+	int nr_threads = opts->nr_threads;
+	int max_requests = opts->max_requests;
 
 	sv = Malloc(sizeof(struct server));
 	sv->nr_threads = nr_threads;
-	sv->max_requests = max_requests + 1;
-	sv->max_cache_size = max_cache_size;
+	sv->max_requests = max_requests;
+	sv->max_cache_size = opts->max_cache_size;
+	sv->zero_copy = opts->zero_copy;
+	sv->idle_timeout = opts->idle_timeout;
 	sv->exiting = 0;
+	sv->overload = opts->overload;
+	sv->hot_path = opts->hot_path;
+	sv->snapshot_path = opts->snapshot_path;
+	sv->snapshot = NULL;
+	sv->stats = stats_init();
+	sv->nr_fds = sysconf(_SC_OPEN_MAX);
+	if (sv->nr_fds < 0 || sv->nr_fds > MAX_TIMED_FDS)
+		sv->nr_fds = MAX_TIMED_FDS;
+	sv->accept_ns = (long *) calloc(sv->nr_fds, sizeof(long));
+	assert(sv->accept_ns);
+	sv->record_path = opts->record_path;
+	sv->access_log = NULL;
+	if (sv->record_path &&
+	    !(sv->access_log = access_log_open(sv->record_path))) {
+		perror(sv->record_path);
+		exit(1);
+	}
+	sv->nr_rejected = 0;
+	sv->nr_dropped = 0;
+	sv->requests = NULL;
+	sv->worker_queues = NULL;
+	sv->sjf_requests = NULL;
+	sv->workers = NULL;
+	sv->pool = NULL;
+	sv->stages = NULL;
 	
-	if (sv->nr_threads > 0 && sv->max_requests > 1) {
-		sv->buffer.requests = (int*) malloc(max_requests * sizeof(int));
-		assert(sv->buffer.requests);
-		sv->buffer.in = 0;
-		sv->buffer.out = 0;
-		sv->buffer.max_size = sv->max_requests;
-
-		sv->threads = (pthread_t*) malloc(nr_threads * sizeof(pthread_t));
-		assert(sv->threads);
-		for (int i=0; i<nr_threads; ++i) {
-			if (pthread_create(&sv->threads[i], NULL, (void * (*)(void *)) worker_thread, sv)) {
-				fprintf(stderr, "Error creating thread #%d\n", i);
-				exit(1);
-			}
-		}
-		if(pthread_cond_init(&sv->cv_full, NULL)) {
-			fprintf(stderr, "Error creating cv_full\n");
-			exit(1);
-		}
-		if(pthread_cond_init(&sv->cv_empty, NULL)) {
-			fprintf(stderr, "Error creating cv_empty\n");
-			exit(1);
+	if (opts->stage_threads[0] > 0) {
+		stages_init(sv, opts->stage_threads);
+	} else if (sv->nr_threads > 0 && sv->max_requests > 0) {
+		if (opts->work_stealing) {
+			// Split max_requests between the workers
+			sv->worker_queues = queue_set_init(nr_threads,
+				(max_requests + nr_threads - 1) / nr_threads);
+		} else if (opts->sjf) {
+			sv->sjf_requests = pqueue_init(sv->max_requests);
+		} else {
+			sv->requests = queue_init(sv->max_requests);
 		}
-		if(pthread_mutex_init(&sv->lock, NULL)) {
-			fprintf(stderr, "Error creating lock\n");
-			exit(1);
+
+		// Start workers only once the queues are ready
+		if (opts->max_threads > 0) {
+			pool_init(sv, opts->min_threads, opts->max_threads);
+		} else {
+			sv->workers = (struct worker*) malloc(nr_threads * sizeof(struct worker));
+			assert(sv->workers);
+			for (int i=0; i<nr_threads; ++i) {
+				worker_start(sv, i);
+			}
 		}
 	}
 
-	if (max_cache_size > 0) {
-		sv->cache = (Cache *) malloc(sizeof(Cache));
-		assert(sv->cache);
-		Cache *cache = sv->cache;
-
-		cache->max_cache_size = max_cache_size;
-		cache->capacity = 5000;
-		cache->table = (CacheEntry *) calloc(sv->cache->capacity, sizeof(CacheEntry));
-		assert(cache->table);
-		cache->size = 0;
-		pthread_mutex_init(&cache->lock, NULL);
-		//pthread_mutex_init(&cache->lock_entry, NULL);
-		//pthread_mutex_init(&cache->lock_exit, NULL);
-		//pthread_mutex_init(&cache->lock_data, NULL);
-		//pthread_cond_init(&cache->cv_rc, NULL);
-
-		cache->LRU = (LRUList *) malloc(sizeof(LRUList));
-		assert(cache->LRU);
-		LRUList *LRU = cache->LRU;
-		LRU->head = NULL;
-		LRU->tail = NULL;
-		LRU->size = 0;
-		//pthread_mutex_init(&LRU->lock_lru, NULL);
+	if (sv->max_cache_size > 0) {
+		sv->nr_cache_shards = opts->nr_cache_shards;
+		sv->cache = cache_init(sv->max_cache_size, opts->nr_cache_shards,
+				       opts->cache_admission, opts->cache_policy);
 	} else sv->cache = NULL;
 
+	if (sv->cache && sv->snapshot_path)
+		server_snapshot_load(sv);
+
+	// Warm up with as many threads as there are workers, unless the
+	// snapshot already filled the cache. The server does not listen for
+	// connections until this is done.
+	if (sv->cache && opts->warmup_path && !sv->snapshot)
+		server_warmup(sv, opts->warmup_path,
+			      nr_threads > 0 ? nr_threads : 1);
+
 	return sv;
 }
 
+/* returns the number of connections waiting for a thread, or for the parse
+ * stage */
+static long
+server_queue_depth(struct server *sv)
+{
+	if (sv->stages)
+		return queue_length(sv->stages[STAGE_PARSE].jobs);
+	if (sv->sjf_requests)
+		return pqueue_length(sv->sjf_requests);
+	if (sv->worker_queues)
+		return queue_set_length(sv->worker_queues);
+	if (sv->requests)
+		return queue_length(sv->requests);
+	return 0;
+}
+
+/* prints the request counts, the cache and queue state, and the request
+ * timings */
+static void
+server_stats_print(struct server *sv, FILE *f)
+{
+	long hits = stats_counter(sv->stats, STATS_HITS);
+	long coalesced = stats_counter(sv->stats, STATS_COALESCED);
+	long lookups = hits + coalesced +
+		stats_counter(sv->stats, STATS_MISSES);
+	struct cache_stats cs;
+
+	fprintf(f, "requests: %ld, bytes sent: %ld\n",
+		stats_counter(sv->stats, STATS_REQUESTS),
+		stats_counter(sv->stats, STATS_BYTES));
+	if (sv->cache) {
+		cache_stats(sv->cache, &cs);
+		fprintf(f, "cache: %ld hits of %ld lookups (%.4f), %ld misses "
+			"coalesced, %ld files, %ld of %ld bytes, "
+			"%ld evictions\n", hits, lookups,
+			lookups ? (double)hits / lookups : 0.0, coalesced,
+			cs.nr_entries, cs.size, cs.max_size, cs.nr_evictions);
+	}
+	if (sv->stages) {
+		fprintf(f, "queue depth: parse %ld, io %ld, send %ld\n",
+			queue_length(sv->stages[STAGE_PARSE].jobs),
+			queue_length(sv->stages[STAGE_IO].jobs),
+			queue_length(sv->stages[STAGE_SEND].jobs));
+	} else {
+		fprintf(f, "queue depth: %ld\n", server_queue_depth(sv));
+	}
+	stats_print(sv->stats, f);
+}
+
+/* queues connfd for a worker. when the queue is full, the overload policy
+ * decides whether to wait, or which connection to turn away */
+static void
+server_enqueue(struct server *sv, int connfd)
+{
+	int oldest;
+
+	switch (sv->overload) {
+	case OVERLOAD_REJECT:
+		if (!queue_push_nowait(sv->requests, connfd)) {
+			TRACE(TRACE_INFO, TRACE_REJECT, connfd, 0, NULL);
+			request_reject(connfd);
+			__atomic_add_fetch(&sv->nr_rejected, 1, __ATOMIC_RELAXED);
+		}
+		break;
+	case OVERLOAD_DROP_OLDEST:
+		while (!queue_push_nowait(sv->requests, connfd)) {
+			// A worker may take the oldest one first, in which case
+			// there is room on the next try
+			if ((oldest = queue_pop_nowait(sv->requests)) >= 0) {
+				TRACE(TRACE_INFO, TRACE_REJECT, oldest, 0,
+				      NULL);
+				request_reject(oldest);
+				__atomic_add_fetch(&sv->nr_rejected, 1,
+						   __ATOMIC_RELAXED);
+				__atomic_add_fetch(&sv->nr_dropped, 1,
+						   __ATOMIC_RELAXED);
+			}
+		}
+		break;
+	default:
+		queue_push(sv->requests, connfd);
+	}
+}
+
 void
 server_request(struct server *sv, int connfd)
 {
-	if (sv->nr_threads == 0 || sv->max_requests <= 1) { /* no worker threads or no buffer */
+	// A descriptor is only reused after the thread that was timing its
+	// last connection closed it, but the closing thread and the acceptor
+	// only synchronize through the kernel
+	if (connfd < sv->nr_fds)
+		__atomic_store_n(&sv->accept_ns[connfd], now_ns(),
+				 __ATOMIC_RELAXED);
+	TRACE(TRACE_INFO, TRACE_ACCEPT, connfd, 0, NULL);
+	if (sv->stages) {
+		/* wait for a free job, then start at the parse stage once
+		 * the request arrives */
+		int i = queue_pop(sv->free_jobs);
+		struct job *job = &sv->jobs[i];
+
+		job->conn = connection_init(connfd);
+		job->fd = connfd;
+		job->first = 1;
+		stage_wait(sv, i);
+	} else if (sv->worker_queues) {
+		queue_set_push(sv->worker_queues, connfd);
+	} else if (sv->sjf_requests) {
+		char file_name[MAXLINE];
+		long size = request_peek(connfd, file_name, MAXLINE);
+		long cost = 0;	/* in us */
+
+		if (size >= 0) {
+			cost = size / SJF_BYTES_PER_US;
+			if (!sv->cache || !cache_contains(sv->cache, file_name))
+				cost += SJF_MISS_COST;
+			if (cost > SJF_MAX_DELAY * 1000L)
+				cost = SJF_MAX_DELAY * 1000L;
+		}
+		pqueue_push(sv->sjf_requests, connfd, now_ns() / 1000 + cost);
+	} else if (sv->requests == NULL) { /* no worker threads or no buffer */
 		do_server_request(sv, connfd);
 	} else {
 		/*  Save the relevant info in a buffer and have one of the
 		 *  worker threads do the work. */
-		add_request(sv, connfd);
+		server_enqueue(sv, connfd);
 	}
 }
 
@@ -659,26 +1229,59 @@ server_exit(struct server *sv)
 	 * these threads that the server is exiting. make sure to call
 	 * pthread_join in this function so that the main server thread waits
 	 * for all the worker threads to exit before exiting. */
-	sv->exiting = 1;
+	__atomic_store_n(&sv->exiting, 1, __ATOMIC_RELAXED);
+
+	if (sv->stages)
+		stages_exit(sv);
+	if (sv->pool) {
+		// Stop resizing the pool before joining its workers
+		pthread_join(sv->pool->thread, NULL);
+	}
+	if (sv->workers) {
+		int nr_slots = sv->pool ? sv->pool->max_threads : sv->nr_threads;
 
-	if (sv->max_requests > 1 && sv->nr_threads > 0) {
 		// Wake up any sleeping worker threads
-		pthread_cond_broadcast(&sv->cv_empty);
+		if (sv->worker_queues)
+			queue_set_close(sv->worker_queues);
+		else if (sv->sjf_requests)
+			pqueue_close(sv->sjf_requests);
+		else
+			queue_close(sv->requests);
 
-		for (int i=0; i<sv->nr_threads; ++i) {
-			pthread_join(sv->threads[i], NULL);
+		for (int i=0; i<nr_slots; ++i) {
+			if (__atomic_load_n(&sv->workers[i].state,
+					    __ATOMIC_ACQUIRE) != WORKER_FREE)
+				pthread_join(sv->workers[i].thread, NULL);
 		}
 	}
 
+	if (sv->overload != OVERLOAD_BLOCK) {
+		printf("overload: %ld rejected, %ld of them dropped from the "
+		       "queue\n", sv->nr_rejected, sv->nr_dropped);
+	}
+	server_stats_print(sv, stdout);
+
 	/* make sure to free any allocated resources */
-	free(sv->buffer.requests);
-	free(sv->threads);
-	//if (sv->cache)
-	//	cache_destroy(sv->cache);
-
-	//pthread_cond_destroy(&sv->cv_empty);
-	//pthread_cond_destroy(&sv->cv_full);
-	//pthread_mutex_destroy(&sv->lock);
+	if (sv->requests)
+		queue_destroy(sv->requests);
+	if (sv->worker_queues)
+		queue_set_destroy(sv->worker_queues);
+	if (sv->sjf_requests)
+		pqueue_destroy(sv->sjf_requests);
+	free(sv->workers);
+	free(sv->pool);
+	if (sv->cache && sv->hot_path && !cache_save(sv->cache, sv->hot_path))
+		perror(sv->hot_path);
+	if (sv->cache && sv->snapshot_path &&
+	    snapshot_save(sv->cache, sv->snapshot_path) < 0)
+		perror(sv->snapshot_path);
+	if (sv->cache)
+		cache_destroy(sv->cache);
+	snapshot_destroy(sv->snapshot);
+	if (sv->access_log && !access_log_close(sv->access_log))
+		perror(sv->record_path);
+	stats_destroy(sv->stats);
+	free(sv->accept_ns);
 
 	free(sv);
 }
@@ -3,8 +3,52 @@
 
 struct server;
 
-struct server *server_init(int nr_threads, int max_requests, 
-			   int max_cache_size);
+/* what the acceptor does with a connection when the queue is full */
+enum overload_policy {
+	OVERLOAD_BLOCK,		/* wait for room */
+	OVERLOAD_REJECT,	/* turn the new connection away with a 503 */
+	OVERLOAD_DROP_OLDEST,	/* turn the longest waiting one away */
+};
+
+/* how to set up the server. unset options are 0 or NULL */
+struct server_options {
+	int nr_threads;
+	int max_requests;
+	int max_cache_size;
+	int nr_cache_shards;
+	/* only cache files that are requested more often than the ones they
+	 * evict */
+	int cache_admission;
+	const char *cache_policy;	/* as cache_policy_exists accepts */
+	/* stream files that the cache cannot hold with sendfile() */
+	int zero_copy;
+	/* ms that a keep-alive connection may stay idle before it is closed */
+	int idle_timeout;
+	/* give each worker its own queue of connections, and let idle
+	 * workers steal from busy ones */
+	int work_stealing;
+	/* thread pool sizes of the parse, io and send stages. with staged
+	 * processing, nr_threads is not used */
+	int stage_threads[3];
+	/* bounds of the adaptive worker pool, if max_threads is set.
+	 * nr_threads is the number of workers to start with */
+	int min_threads;
+	int max_threads;
+	int sjf;		/* serve queued connections for small files first */
+	enum overload_policy overload;
+	/* fill the cache before accepting connections with the files named
+	 * in this fileset index or hot file list */
+	const char *warmup_path;
+	/* on exit, save the cached files here, hottest first */
+	const char *hot_path;
+	/* on exit, save the cache here, and serve from it on the next start */
+	const char *snapshot_path;
+	/* record the arrival time and uri of each request here, for
+	 * client -R */
+	const char *record_path;
+};
+
+struct server *server_init(const struct server_options *opts);
 void server_request(struct server *sv, int connfd);
 void server_exit(struct server *sv);
 
@@ -0,0 +1,108 @@
+/*
+ * sketch.c: Count-min sketch for estimating how often a file is requested.
+ *
+ * Each of the SKETCH_DEPTH rows has its own hash of the file name hash, and
+ * the estimate is the smallest counter over all rows. Counters saturate at
+ * SKETCH_MAX_COUNT. After every width * SKETCH_SAMPLE_FACTOR increments all
+ * counters are halved, so that the sketch follows recent popularity rather
+ * than all-time popularity.
+ *
+ * Counters are updated with atomic operations but without a lock, so
+ * concurrent increments may occasionally be lost. This only makes the
+ * estimates slightly less precise.
+ */
+
+#include "common.h"
+#include "sketch.h"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_COUNT 15
+#define SKETCH_SAMPLE_FACTOR 10
+
+struct sketch {
+	unsigned char *counters;	/* SKETCH_DEPTH rows of width counters */
+	unsigned long width;	/* always a power of two */
+	long nr_increments;	/* since the last aging */
+	long sample_size;
+};
+
+/* odd multipliers that give each row its own hash */
+static const unsigned long sketch_seeds[SKETCH_DEPTH] = {
+	0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL,
+	0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL,
+};
+
+struct sketch *
+sketch_init(long width)
+{
+	struct sketch *sk = Malloc(sizeof(struct sketch));
+
+	sk->width = 1;
+	while (sk->width < width)
+		sk->width *= 2;
+	sk->counters = calloc(SKETCH_DEPTH * sk->width, 1);
+	assert(sk->counters);
+	sk->nr_increments = 0;
+	sk->sample_size = sk->width * SKETCH_SAMPLE_FACTOR;
+	return sk;
+}
+
+static unsigned char *
+sketch_counter(struct sketch *sk, int row, unsigned long hash)
+{
+	unsigned long h = (hash ^ (hash >> 29)) * sketch_seeds[row];
+
+	return &sk->counters[row * sk->width + ((h >> 32) & (sk->width - 1))];
+}
+
+/* halve every counter */
+static void
+sketch_age(struct sketch *sk)
+{
+	unsigned long i;
+
+	for (i = 0; i < SKETCH_DEPTH * sk->width; i++) {
+		unsigned char c = __atomic_load_n(&sk->counters[i],
+						  __ATOMIC_RELAXED);
+		__atomic_store_n(&sk->counters[i], c / 2, __ATOMIC_RELAXED);
+	}
+}
+
+void
+sketch_increment(struct sketch *sk, unsigned long hash)
+{
+	int row;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		unsigned char *counter = sketch_counter(sk, row, hash);
+		unsigned char c = __atomic_load_n(counter, __ATOMIC_RELAXED);
+		if (c < SKETCH_MAX_COUNT)
+			__sync_bool_compare_and_swap(counter, c, c + 1);
+	}
+	/* only the thread that reaches the sample size does the aging */
+	if (__sync_add_and_fetch(&sk->nr_increments, 1) == sk->sample_size) {
+		sketch_age(sk);
+		__sync_fetch_and_sub(&sk->nr_increments, sk->sample_size);
+	}
+}
+
+int
+sketch_estimate(struct sketch *sk, unsigned long hash)
+{
+	int row, min = SKETCH_MAX_COUNT;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		unsigned char c = __atomic_load_n(sketch_counter(sk, row, hash),
+						  __ATOMIC_RELAXED);
+		if (c < min)
+			min = c;
+	}
+	return min;
+}
+
+void
+sketch_destroy(struct sketch *sk)
+{
+	free(sk->counters);
+	free(sk);
+}
@@ -0,0 +1,11 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+struct sketch;
+
+struct sketch *sketch_init(long width);
+void sketch_increment(struct sketch *sk, unsigned long hash);
+int sketch_estimate(struct sketch *sk, unsigned long hash);
+void sketch_destroy(struct sketch *sk);
+
+#endif /* __SKETCH_H__ */
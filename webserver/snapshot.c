@@ -0,0 +1,223 @@
+/*
+ * snapshot.c: Saves the file cache to a single file on exit, and serves from
+ * it straight away on the next start.
+ *
+ * The snapshot starts with a header, followed by one record per cached file
+ * in the order the cache would evict them, the hottest last. Each record
+ * holds the file's name, response header and contents, along with the size,
+ * checksum and modification time that the file had when it was read. Every
+ * record starts at a multiple of SNAPSHOT_ALIGN bytes.
+ *
+ * Loading maps the snapshot and inserts every file that has not changed on
+ * disk since it was saved, and whose contents still match their checksum, in
+ * snapshot order, so the cache ends up with the same eviction order it had.
+ * The cached files point into the mapping rather than being copied, so the
+ * mapping must outlive the cache. The snapshot is written to a temporary
+ * file that is then renamed, so the mapping that is being saved from stays
+ * valid, and a crash while saving leaves the old snapshot behind.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "bytesum.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "WSSNAP1\n"
+#define SNAPSHOT_ALIGN 8
+
+struct snapshot_header {
+	char magic[8];
+	long nr_entries;
+};
+
+/* followed by the name, with its nul, the header and the file contents */
+struct snapshot_record {
+	int name_len;
+	int header_size;
+	int file_size;
+	unsigned int csum;	/* bytesum of the file contents */
+	long mtime_sec;
+	long mtime_nsec;
+};
+
+struct snapshot {
+	void *addr;
+	size_t size;
+};
+
+static long
+snapshot_align(long size)
+{
+	return (size + SNAPSHOT_ALIGN - 1) & ~(long)(SNAPSHOT_ALIGN - 1);
+}
+
+static int
+snapshot_write(FILE *f, struct file_data *data)
+{
+	static const char pad[SNAPSHOT_ALIGN];
+	struct snapshot_record rec;
+	long len;
+
+	rec.name_len = strlen(data->file_name) + 1;
+	rec.header_size = data->header_size;
+	rec.file_size = data->file_size;
+	rec.csum = bytesum(data->file_buf, data->file_size);
+	rec.mtime_sec = data->mtime.tv_sec;
+	rec.mtime_nsec = data->mtime.tv_nsec;
+	len = sizeof(rec) + rec.name_len + rec.header_size + rec.file_size;
+
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+	    fwrite(data->file_name, rec.name_len, 1, f) != 1 ||
+	    fwrite(data->header, rec.header_size, 1, f) != 1 ||
+	    (rec.file_size > 0 &&
+	     fwrite(data->file_buf, rec.file_size, 1, f) != 1))
+		return 0;
+	return fwrite(pad, snapshot_align(len) - len, 1, f) == 1 ||
+		snapshot_align(len) == len;
+}
+
+/* writes every cached file to path. returns the number of files written, or
+ * -1 if path could not be written. */
+int
+snapshot_save(Cache *cache, const char *path)
+{
+	struct snapshot_header hdr;
+	struct file_data **files;
+	char tmp[MAXLINE];
+	long nr_files, i;
+	int ok, nr_written = 0;
+	FILE *f;
+
+	snprintf(tmp, MAXLINE, "%s.tmp", path);
+	if ((f = fopen(tmp, "w")) == NULL)
+		return -1;
+	nr_files = cache_files(cache, &files);
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.nr_entries = 0;
+	for (i = 0; i < nr_files; i++) {
+		if (files[i]->file_buf && files[i]->header)
+			hdr.nr_entries++;
+	}
+	ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	for (i = 0; i < nr_files; i++) {
+		if (ok && files[i]->file_buf && files[i]->header) {
+			ok = snapshot_write(f, files[i]);
+			nr_written++;
+		}
+		file_data_put(files[i]);
+	}
+	free(files);
+	if (fclose(f) != 0 || !ok || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return nr_written;
+}
+
+/* whether the file named in rec is still the one that was saved */
+static int
+snapshot_valid(const char *name, struct snapshot_record *rec)
+{
+	struct stat sbuf;
+
+	return stat(name, &sbuf) == 0 && S_ISREG(sbuf.st_mode) &&
+		sbuf.st_size == rec->file_size &&
+		sbuf.st_mtim.tv_sec == rec->mtime_sec &&
+		sbuf.st_mtim.tv_nsec == rec->mtime_nsec;
+}
+
+/* maps the snapshot at path and caches the files in it that are unchanged
+ * on disk. returns the mapping, to be destroyed after the cache, or NULL if
+ * there is no usable snapshot. sets *nr_cached to the number of files
+ * cached, and *nr_entries to the number of files in the snapshot. */
+struct snapshot *
+snapshot_load(Cache *cache, const char *path, int *nr_cached,
+	      int *nr_entries)
+{
+	struct snapshot_header *hdr;
+	struct snapshot *snap;
+	struct stat sbuf;
+	char *p, *end;
+	long i;
+	int fd;
+
+	*nr_cached = *nr_entries = 0;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			perror(path);
+		return NULL;
+	}
+	if (fstat(fd, &sbuf) < 0 || sbuf.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "%s: not a snapshot\n", path);
+		close(fd);
+		return NULL;
+	}
+	snap = Malloc(sizeof(struct snapshot));
+	snap->size = sbuf.st_size;
+	snap->addr = mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (snap->addr == MAP_FAILED) {
+		perror(path);
+		free(snap);
+		return NULL;
+	}
+	hdr = snap->addr;
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic))) {
+		fprintf(stderr, "%s: not a snapshot\n", path);
+		snapshot_destroy(snap);
+		return NULL;
+	}
+
+	p = (char *)snap->addr + sizeof(*hdr);
+	end = (char *)snap->addr + snap->size;
+	for (i = 0; i < hdr->nr_entries; i++) {
+		struct snapshot_record *rec = (struct snapshot_record *)p;
+		struct file_data *data;
+		char *name;
+		long len;
+
+		if (end - p < sizeof(*rec) || rec->name_len <= 0 ||
+		    rec->header_size <= 0 || rec->file_size < 0)
+			break;
+		len = sizeof(*rec) + (long)rec->name_len + rec->header_size +
+			rec->file_size;
+		if (end - p < len)
+			break;
+		name = p + sizeof(*rec);
+		if (name[rec->name_len - 1] != '\0')
+			break;
+		p += snapshot_align(len);
+		(*nr_entries)++;
+		if (!snapshot_valid(name, rec))
+			continue;
+
+		data = file_data_init();
+		data->file_name = strdup(name);
+		assert(data->file_name);
+		data->header = name + rec->name_len;
+		data->header_size = rec->header_size;
+		data->file_buf = data->header + rec->header_size;
+		data->file_size = rec->file_size;
+		data->mtime.tv_sec = rec->mtime_sec;
+		data->mtime.tv_nsec = rec->mtime_nsec;
+		data->mapped = 1;
+		if (bytesum(data->file_buf, data->file_size) == rec->csum &&
+		    cache_insert(cache, data))
+			(*nr_cached)++;
+		file_data_put(data);
+	}
+	if (i < hdr->nr_entries)
+		fprintf(stderr, "%s: truncated after %ld of %ld files\n",
+			path, i, hdr->nr_entries);
+	return snap;
+}
+
+void
+snapshot_destroy(struct snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+	SYS(munmap(snap->addr, snap->size));
+	free(snap);
+}
@@ -0,0 +1,12 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+struct snapshot;
+struct cache;
+
+int snapshot_save(struct cache *cache, const char *path);
+struct snapshot *snapshot_load(struct cache *cache, const char *path,
+			       int *nr_cached, int *nr_entries);
+void snapshot_destroy(struct snapshot *snap);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,257 @@
+/*
+ * stats.c: Per-thread request latency histograms and counters.
+ *
+ * Every thread that records has its own histograms, one per phase, so
+ * recording never takes a lock or writes to memory that another thread
+ * writes. Only the owner writes a thread's histograms, with relaxed atomic
+ * stores, and readers add up the histograms of all threads with relaxed
+ * loads. A reader may miss the records made while it reads.
+ *
+ * The histograms are log-linear, like HDR histograms. Values below
+ * 2 * STATS_SUB_BUCKETS ns have a bucket each, and each power of two above
+ * that is split into STATS_SUB_BUCKETS buckets, so every bucket is within
+ * 1 / STATS_SUB_BUCKETS of the values in it. Percentiles are reported as the
+ * largest value of the bucket they fall in, but at most the largest value
+ * recorded.
+ *
+ * A thread finds its histograms through a thread-specific key. When the
+ * thread exits they are kept, and the next thread that records takes them
+ * over, so that an adaptive pool does not use more memory as workers come
+ * and go.
+ */
+
+#include "common.h"
+#include "stats.h"
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+/* values are capped at 2^STATS_MAX_BITS - 1 ns, about 18 minutes */
+#define STATS_MAX_BITS 40
+#define STATS_NR_BUCKETS \
+	((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+static const char *stats_phase_names[STATS_NR_PHASES] = {
+	"queue", "parse", "lookup", "disk", "process", "send", "total"
+};
+
+static const double stats_percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define STATS_NR_PERCENTILES \
+	(sizeof(stats_percentiles) / sizeof(stats_percentiles[0]))
+
+struct stats_thread {
+	long counts[STATS_NR_PHASES][STATS_NR_BUCKETS];
+	long sum[STATS_NR_PHASES];	/* of the values recorded, in ns */
+	long max[STATS_NR_PHASES];
+	long counters[STATS_NR_COUNTERS];
+	int owned;		/* by a running thread */
+	struct stats_thread *next;
+};
+
+struct stats {
+	pthread_key_t key;
+	pthread_mutex_t lock;	/* protects the list of threads */
+	struct stats_thread *threads;
+};
+
+/* returns the bucket of ns */
+static int
+stats_bucket(long ns)
+{
+	unsigned long v = ns < 0 ? 0 : ns;
+	int shift;
+
+	if (v >= 1UL << STATS_MAX_BITS)
+		v = (1UL << STATS_MAX_BITS) - 1;
+	if (v < 2 * STATS_SUB_BUCKETS)
+		return v;
+	shift = 63 - __builtin_clzl(v) - STATS_SUB_BITS;
+	return (shift + 1) * STATS_SUB_BUCKETS + (v >> shift) -
+		STATS_SUB_BUCKETS;
+}
+
+/* returns the largest value in bucket i */
+static long
+stats_bucket_max(int i)
+{
+	int shift;
+
+	if (i < 2 * STATS_SUB_BUCKETS)
+		return i;
+	shift = i / STATS_SUB_BUCKETS - 1;
+	return ((long)(i % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS + 1) <<
+		shift) - 1;
+}
+
+/* only the owner adds to its own values */
+static void
+stats_inc(long *value, long n)
+{
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+static void
+stats_thread_exit(void *arg)
+{
+	struct stats_thread *t = arg;
+
+	__atomic_store_n(&t->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* returns the calling thread's histograms */
+static struct stats_thread *
+stats_self(struct stats *st)
+{
+	struct stats_thread *t = pthread_getspecific(st->key);
+
+	if (t)
+		return t;
+	pthread_mutex_lock(&st->lock);
+	for (t = st->threads; t; t = t->next) {
+		if (!__atomic_load_n(&t->owned, __ATOMIC_ACQUIRE))
+			break;
+	}
+	if (t == NULL) {
+		t = calloc(1, sizeof(struct stats_thread));
+		assert(t);
+		t->next = st->threads;
+		st->threads = t;
+	}
+	t->owned = 1;
+	pthread_mutex_unlock(&st->lock);
+	SYS(pthread_setspecific(st->key, t));
+	return t;
+}
+
+struct stats *
+stats_init(void)
+{
+	struct stats *st = Malloc(sizeof(struct stats));
+
+	SYS(pthread_key_create(&st->key, stats_thread_exit));
+	pthread_mutex_init(&st->lock, NULL);
+	st->threads = NULL;
+	return st;
+}
+
+/* records that phase took ns for a request */
+void
+stats_record(struct stats *st, enum stats_phase phase, long ns)
+{
+	struct stats_thread *t = stats_self(st);
+
+	stats_inc(&t->counts[phase][stats_bucket(ns)], 1);
+	stats_inc(&t->sum[phase], ns);
+	if (ns > t->max[phase])
+		__atomic_store_n(&t->max[phase], ns, __ATOMIC_RELAXED);
+}
+
+void
+stats_add(struct stats *st, enum stats_counter counter, long n)
+{
+	stats_inc(&stats_self(st)->counters[counter], n);
+}
+
+/* returns the counter summed over all threads */
+long
+stats_counter(struct stats *st, enum stats_counter counter)
+{
+	struct stats_thread *t;
+	long n = 0;
+
+	pthread_mutex_lock(&st->lock);
+	for (t = st->threads; t; t = t->next) {
+		n += __atomic_load_n(&t->counters[counter], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return n;
+}
+
+/* adds up the histograms of all threads into total */
+static void
+stats_merge(struct stats *st, struct stats_thread *total)
+{
+	struct stats_thread *t;
+	long max;
+	int p, i;
+
+	memset(total, 0, sizeof(*total));
+	pthread_mutex_lock(&st->lock);
+	for (t = st->threads; t; t = t->next) {
+		for (p = 0; p < STATS_NR_PHASES; p++) {
+			for (i = 0; i < STATS_NR_BUCKETS; i++) {
+				total->counts[p][i] += __atomic_load_n(
+					&t->counts[p][i], __ATOMIC_RELAXED);
+			}
+			total->sum[p] += __atomic_load_n(&t->sum[p],
+							 __ATOMIC_RELAXED);
+			max = __atomic_load_n(&t->max[p], __ATOMIC_RELAXED);
+			if (max > total->max[p])
+				total->max[p] = max;
+		}
+	}
+	pthread_mutex_unlock(&st->lock);
+}
+
+/* prints, for every phase, the number of requests timed, the mean and
+ * percentiles in us, and then the histogram buckets that are not empty as
+ * pairs of the bucket's largest value in us and its count */
+void
+stats_print(struct stats *st, FILE *f)
+{
+	struct stats_thread *total = Malloc(sizeof(struct stats_thread));
+	long count, seen, value;
+	int p, i, q;
+
+	stats_merge(st, total);
+	fprintf(f, "%-8s %10s %10s %10s %10s %10s %10s %10s\n", "phase",
+		"count", "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us",
+		"max_us");
+	for (p = 0; p < STATS_NR_PHASES; p++) {
+		count = 0;
+		for (i = 0; i < STATS_NR_BUCKETS; i++) {
+			count += total->counts[p][i];
+		}
+		fprintf(f, "%-8s %10ld %10.1f", stats_phase_names[p], count,
+			count ? total->sum[p] / 1e3 / count : 0.0);
+		for (q = 0, i = 0, seen = 0; q < STATS_NR_PERCENTILES; q++) {
+			/* the smallest bucket with at least this fraction
+			 * of the values at or below it */
+			while (i < STATS_NR_BUCKETS &&
+			       seen + total->counts[p][i] <
+			       stats_percentiles[q] * count)
+				seen += total->counts[p][i++];
+			if (count == 0 || i == STATS_NR_BUCKETS)
+				value = 0;
+			else if ((value = stats_bucket_max(i)) > total->max[p])
+				value = total->max[p];
+			fprintf(f, " %10.1f", value / 1e3);
+		}
+		fprintf(f, " %10.1f\n", total->max[p] / 1e3);
+	}
+	for (p = 0; p < STATS_NR_PHASES; p++) {
+		fprintf(f, "histogram %s:", stats_phase_names[p]);
+		for (i = 0; i < STATS_NR_BUCKETS; i++) {
+			if (total->counts[p][i])
+				fprintf(f, " %.3f:%ld", stats_bucket_max(i) / 1e3,
+					total->counts[p][i]);
+		}
+		fprintf(f, "\n");
+	}
+	free(total);
+}
+
+/* frees the histograms of all threads. no thread may record any more */
+void
+stats_destroy(struct stats *st)
+{
+	struct stats_thread *t;
+
+	while ((t = st->threads)) {
+		st->threads = t->next;
+		free(t);
+	}
+	pthread_key_delete(st->key);
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+}
@@ -0,0 +1,38 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+
+/* the parts of a request that are timed */
+enum stats_phase {
+	STATS_QUEUE,	/* from accept until a thread takes the connection */
+	STATS_PARSE,	/* reading the request */
+	STATS_LOOKUP,	/* looking the file up in the cache */
+	STATS_DISK,	/* reading the file on a miss */
+	STATS_PROCESS,	/* processing the file before it is sent */
+	STATS_SEND,	/* writing the response */
+	STATS_TOTAL,	/* from reading the request until it is sent */
+	STATS_NR_PHASES
+};
+
+/* counts kept along with the timings */
+enum stats_counter {
+	STATS_REQUESTS,
+	STATS_HITS,
+	STATS_MISSES,
+	STATS_COALESCED,	/* misses that waited for another request's
+				 * read of the file */
+	STATS_BYTES,	/* bytes of responses sent */
+	STATS_NR_COUNTERS
+};
+
+struct stats;
+
+struct stats *stats_init(void);
+void stats_record(struct stats *st, enum stats_phase phase, long ns);
+void stats_add(struct stats *st, enum stats_counter counter, long n);
+long stats_counter(struct stats *st, enum stats_counter counter);
+void stats_print(struct stats *st, FILE *f);
+void stats_destroy(struct stats *st);
+
+#endif /* __STATS_H__ */
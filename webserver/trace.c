@@ -0,0 +1,223 @@
+/*
+ * trace.c: Binary event tracing for the server's hot paths.
+ *
+ * Each thread records events into its own ring of TRACE_RING_SIZE fixed-size
+ * records. Only the owner writes to a ring, and it never waits: once the
+ * ring is full, each new event overwrites the oldest one. Recording an event
+ * costs a clock read and a copy of one record, so the server can leave
+ * tracing on where printf would serialize all threads on the stdout lock.
+ *
+ * trace_dump writes the events left in all rings to a file, which the
+ * trace_decode program turns into text. The rings are only dumped once the
+ * threads that record into them are done.
+ *
+ * A thread finds its ring through a thread-specific key. When the thread
+ * exits, its ring is kept, and the next thread that starts recording takes
+ * it over.
+ */
+
+#include "common.h"
+#include "trace.h"
+
+/* records per ring, a power of two */
+#define TRACE_RING_SIZE 4096
+
+struct trace_ring {
+	struct trace_record records[TRACE_RING_SIZE];
+	unsigned long head;	/* records ever written */
+	int thread;
+	int owned;		/* by a running thread */
+	struct trace_ring *next;
+};
+
+int trace_level = TRACE_OFF;
+
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings;	/* protected by trace_lock */
+static int trace_nr_rings;
+
+static const char *trace_level_names[] = { "off", "error", "info", "debug" };
+
+static void
+trace_thread_exit(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	__atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* starts recording the events at or below level */
+void
+trace_init(int level)
+{
+	SYS(pthread_key_create(&trace_key, trace_thread_exit));
+	__atomic_store_n(&trace_level, level, __ATOMIC_RELAXED);
+}
+
+/* returns the calling thread's ring */
+static struct trace_ring *
+trace_self(void)
+{
+	struct trace_ring *ring = pthread_getspecific(trace_key);
+
+	if (ring)
+		return ring;
+	pthread_mutex_lock(&trace_lock);
+	for (ring = trace_rings; ring; ring = ring->next) {
+		if (!__atomic_load_n(&ring->owned, __ATOMIC_ACQUIRE))
+			break;
+	}
+	if (ring == NULL) {
+		ring = Malloc(sizeof(struct trace_ring));
+		ring->head = 0;
+		ring->thread = trace_nr_rings++;
+		ring->next = trace_rings;
+		trace_rings = ring;
+	}
+	ring->owned = 1;
+	pthread_mutex_unlock(&trace_lock);
+	SYS(pthread_setspecific(trace_key, ring));
+	return ring;
+}
+
+/* records an event. use the TRACE macro, which checks the level first */
+void
+trace_event(int level, enum trace_event event, long a, long b,
+	    const char *s)
+{
+	struct trace_ring *ring = trace_self();
+	unsigned long head = ring->head;
+	struct trace_record *rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+	struct timespec ts;
+	size_t len;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec->ns = ts.tv_sec * 1000000000L + ts.tv_nsec;
+	rec->event = event;
+	rec->level = level;
+	rec->thread = ring->thread;
+	rec->a = a;
+	rec->b = b;
+	len = 0;
+	if (s) {
+		len = strlen(s);
+		if (len > TRACE_STR_LEN) {
+			s += len - TRACE_STR_LEN;
+			len = TRACE_STR_LEN;
+		}
+		memcpy(rec->s, s, len);
+	}
+	rec->s[len] = '\0';
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* writes the events in all rings to path, oldest first in each ring.
+ * returns 0 if path could not be written. */
+int
+trace_dump(const char *path)
+{
+	struct trace_file_header hdr;
+	struct trace_ring *ring;
+	unsigned long head, first;
+	int ok;
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL)
+		return 0;
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.record_size = sizeof(struct trace_record);
+	hdr.nr_records = 0;
+	pthread_mutex_lock(&trace_lock);
+	for (ring = trace_rings; ring; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		hdr.nr_records += head < TRACE_RING_SIZE ? head :
+			TRACE_RING_SIZE;
+	}
+	ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	for (ring = trace_rings; ok && ring; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		first = head < TRACE_RING_SIZE ? 0 : head - TRACE_RING_SIZE;
+		for (; ok && first < head; first++) {
+			ok = fwrite(&ring->records[first &
+						   (TRACE_RING_SIZE - 1)],
+				    sizeof(struct trace_record), 1, f) == 1;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return fclose(f) == 0 && ok;
+}
+
+/* stops tracing and frees the rings. no thread may record any more */
+void
+trace_destroy(void)
+{
+	struct trace_ring *ring;
+
+	__atomic_store_n(&trace_level, TRACE_OFF, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&trace_lock);
+	while ((ring = trace_rings)) {
+		trace_rings = ring->next;
+		free(ring);
+	}
+	trace_nr_rings = 0;
+	pthread_mutex_unlock(&trace_lock);
+	pthread_key_delete(trace_key);
+}
+
+/* returns the level called name, or -1 if there is none */
+int
+trace_level_find(const char *name)
+{
+	int level;
+
+	for (level = TRACE_OFF; level <= TRACE_DEBUG; level++) {
+		if (strcmp(name, trace_level_names[level]) == 0)
+			return level;
+	}
+	return -1;
+}
+
+const char *
+trace_level_name(int level)
+{
+	if (level < TRACE_OFF || level > TRACE_DEBUG)
+		return "?";
+	return trace_level_names[level];
+}
+
+/* prints the event in rec as text, without a newline */
+void
+trace_print(FILE *f, const struct trace_record *rec)
+{
+	switch (rec->event) {
+	case TRACE_ACCEPT:
+		fprintf(f, "accept fd %ld", rec->a);
+		break;
+	case TRACE_REJECT:
+		fprintf(f, "reject fd %ld", rec->a);
+		break;
+	case TRACE_REQUEST:
+		fprintf(f, "request fd %ld %s", rec->a, rec->s);
+		break;
+	case TRACE_HIT:
+		fprintf(f, "hit %s %ld bytes", rec->s, rec->a);
+		break;
+	case TRACE_MISS:
+		fprintf(f, "miss %s", rec->s);
+		break;
+	case TRACE_INSERT:
+		fprintf(f, "insert %s %ld bytes, %s", rec->s, rec->b,
+			rec->a ? "cached" : "not cached");
+		break;
+	case TRACE_EVICT:
+		fprintf(f, "evict %s %ld bytes", rec->s, rec->a);
+		break;
+	case TRACE_HTTP_ERROR:
+		fprintf(f, "error %ld fd %ld %s", rec->a, rec->b, rec->s);
+		break;
+	default:
+		fprintf(f, "event %d a=%ld b=%ld %s", rec->event, rec->a,
+			rec->b, rec->s);
+	}
+}
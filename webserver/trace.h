@@ -0,0 +1,74 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+
+/* trace levels. events above TRACE_MAX_LEVEL are compiled out, and events
+ * above trace_level are skipped at run time. build with
+ * -DTRACE_MAX_LEVEL=0 to leave no tracing in the server at all. */
+#define TRACE_OFF 0
+#define TRACE_ERROR 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
+
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_DEBUG
+#endif
+
+enum trace_event {
+	TRACE_ACCEPT,	/* a: connection fd */
+	TRACE_REJECT,	/* a: connection fd, turned away when overloaded */
+	TRACE_REQUEST,	/* a: connection fd, s: file */
+	TRACE_HIT,	/* a: file size, s: file */
+	TRACE_MISS,	/* s: file */
+	TRACE_INSERT,	/* a: 1 if cached, b: file size, s: file */
+	TRACE_EVICT,	/* a: file size, s: file */
+	TRACE_HTTP_ERROR,	/* a: status, b: connection fd, s: cause */
+	TRACE_NR_EVENTS
+};
+
+/* the longest string kept with an event. longer strings keep their end,
+ * which tells file names apart best */
+#define TRACE_STR_LEN 31
+
+/* an event as it is stored in a trace ring and in a trace file */
+struct trace_record {
+	long ns;		/* CLOCK_MONOTONIC */
+	short event;
+	short level;
+	int thread;		/* the ring the event was recorded in */
+	long a;
+	long b;
+	char s[TRACE_STR_LEN + 1];
+};
+
+#define TRACE_MAGIC "WSTRACE1"
+
+/* a trace file is this header followed by nr_records records */
+struct trace_file_header {
+	char magic[8];
+	int record_size;
+	int nr_records;
+};
+
+extern int trace_level;
+
+#define TRACE(level, event, a, b, s)					\
+	do {								\
+		if ((level) <= TRACE_MAX_LEVEL &&			\
+		    (level) <= __atomic_load_n(&trace_level,		\
+					       __ATOMIC_RELAXED))	\
+			trace_event(level, event, a, b, s);		\
+	} while (0)
+
+void trace_init(int level);
+void trace_event(int level, enum trace_event event, long a, long b,
+		 const char *s);
+int trace_dump(const char *path);
+void trace_destroy(void);
+
+int trace_level_find(const char *name);
+const char *trace_level_name(int level);
+void trace_print(FILE *f, const struct trace_record *rec);
+
+#endif /* __TRACE_H__ */
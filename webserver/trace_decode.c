@@ -0,0 +1,68 @@
+/*
+ * trace_decode.c: Prints a trace file written by the server as text.
+ *
+ * To run:
+ *  trace_decode trace_file
+ *
+ * Prints one line per event, ordered by time, with the time in us since the
+ * first event, the thread, the level and the event itself.
+ */
+
+#include "common.h"
+#include "trace.h"
+
+static int
+record_cmp(const void *a, const void *b)
+{
+	long x = ((const struct trace_record *)a)->ns;
+	long y = ((const struct trace_record *)b)->ns;
+
+	return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct trace_file_header hdr;
+	struct trace_record *records;
+	FILE *f;
+	int i;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s trace_file\n", argv[0]);
+		exit(1);
+	}
+	if ((f = fopen(argv[1], "r")) == NULL) {
+		perror(argv[1]);
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.record_size != sizeof(struct trace_record) ||
+	    hdr.nr_records < 0) {
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		exit(1);
+	}
+	records = Malloc((hdr.nr_records + 1) * sizeof(struct trace_record));
+	if (fread(records, sizeof(struct trace_record), hdr.nr_records, f) !=
+	    hdr.nr_records) {
+		fprintf(stderr, "%s: truncated\n", argv[1]);
+		exit(1);
+	}
+	fclose(f);
+
+	/* each thread's events are in order, but threads are interleaved */
+	qsort(records, hdr.nr_records, sizeof(struct trace_record),
+	      record_cmp);
+	for (i = 0; i < hdr.nr_records; i++) {
+		struct trace_record *rec = &records[i];
+
+		rec->s[TRACE_STR_LEN] = '\0';
+		printf("%12.3f t%-3d %-5s ", (rec->ns - records[0].ns) / 1e3,
+		       rec->thread, trace_level_name(rec->level));
+		trace_print(stdout, rec);
+		printf("\n");
+	}
+	free(records);
+	exit(0);
+}